@@ -9,6 +9,9 @@
 #include <vector>
 #include <string>
 #include <thread>
+#include <memory>
+#include <future>
+#include <filesystem>
 #include <algorithm> // For std::pair and std::min and max
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -16,6 +19,9 @@
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../util/stb_image_write.h"
+#include "../util/EXRWriter.h"
+#include "../util/VideoStream.h"
+#include "../util/PNGWriter.h"
 
 #if _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -29,6 +35,9 @@
 #include "renderer/Scene.h"
 #include "renderer/HDREnvironment.h"
 #include "renderer/Renderer.h"
+#include "renderer/Denoiser.h"
+#include "renderer/Tonemap.h"
+#include "renderer/Checkpoint.h"
 #include "renderer/ColouringFunction.h"
 
 #include "scene_objects/SimpleObjects.h"
@@ -59,33 +68,111 @@ struct sRGBPixel
 };
 
 
-void renderPasses(std::vector<std::thread> & threads, RenderOutput & output, int frame, int base_pass, int num_passes, int frames, Scene & scene, const HDREnvironment * hdr_env) noexcept
+// Returns false if the passes were cancelled by the deadline before completing
+bool renderPasses(std::vector<std::thread> & threads, RenderOutput & output, int frame, int base_pass, int num_passes, int frames, Scene & scene, const HDREnvironment * hdr_env,
+	const RenderSettings & settings, const Clock::time_point deadline = Clock::time_point::max(), const AdaptiveSampling * adaptive = nullptr, PathGuiding * guiding = nullptr,
+	RadianceCache * radiance_cache = nullptr, const StartDistanceGrid * start_distances = nullptr) noexcept
 {
-	ThreadControl thread_control = { num_passes };
+	ThreadControl thread_control(num_passes, (int)threads.size(), deadline, adaptive, numBuckets(output.xres) * numBuckets(output.yres));
+	scene.camera.setFrame(frame, frames, output.image_xres, output.image_yres, output.x0, output.y0, output.pixel_scale);
 
-	for (std::thread & t : threads) t = std::thread(renderThreadFunction, &thread_control, &output, frame, base_pass, frames, &scene, hdr_env);
+	for (std::thread & t : threads) t = std::thread(renderThreadFunction, &thread_control, &output, base_pass, &scene, hdr_env, &settings, guiding, radiance_cache, start_distances);
 	for (std::thread & t : threads) t.join();
+
+	return !thread_control.cancelled;
 }
 
 
-void tonemap(std::vector<sRGBPixel> & image_LDR, const std::vector<vec3f> & image_HDR, const int passes, const int xres, const int yres) noexcept
+// Load an environment map, preferring a preprocessed cache file next to it which is memory mapped without copies.
+// If there is no valid cache, the map is decoded and preprocessed as usual and the cache is written for the next run.
+bool loadEnvironment(HDREnvironment & hdr_env, const std::string & path, const bool packed, const int cubemap_res, const int rough_lod)
 {
-	const auto sRGB = [](float u) -> float { return (u <= 0.0031308f) ? 12.92f * u : 1.055f * std::pow(u, 0.416667f) - 0.055f; };
-	const float scale = 1.0f / passes;
+	const auto t0 = Clock::now();
+	const std::string cache_path = path + ".ftcache";
 
-	#pragma omp parallel for
-	for (int y = 0; y < yres; y++)
-	for (int x = 0; x < xres; x++)
+	// Identify the source file by its size and modification time
+	std::error_code ec;
+	const uint64_t source_size = std::filesystem::file_size(path, ec);
+	const uint64_t source_time = ec ? 0 : (uint64_t)std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+	if (ec)
+	{
+		fprintf(stderr, "Failed to load HDR environment map: %s\n", path.c_str());
+		return false;
+	}
+	const uint64_t source_stamp = source_size * 0x9E3779B97F4A7C15ull ^ source_time;
+
+	const bool cached = hdr_env.mapCache(cache_path, source_stamp, packed, cubemap_res);
+	if (!cached)
 	{
-		const int pixel_idx = y * xres + x;
-		const vec3f pixel_colour = image_HDR[pixel_idx];
+		int channels;
+		float * hdr_data = stbi_loadf(path.c_str(), &hdr_env.xres, &hdr_env.yres, &channels, 3);
+		if (hdr_data == nullptr)
+		{
+			fprintf(stderr, "Failed to load HDR environment map: %s\n", path.c_str());
+			return false;
+		}
 
-		image_LDR[pixel_idx] =
+		hdr_env.image.resize(hdr_env.xres, hdr_env.yres, packed);
+		#pragma omp parallel for
+		for (int y = 0; y < hdr_env.yres; ++y)
+		for (int x = 0; x < hdr_env.xres; ++x)
 		{
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.x() * scale) * 256)),
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.y() * scale) * 256)),
-			(uint8_t)std::max(0.0f, std::min(255.0f, sRGB(pixel_colour.z() * scale) * 256))
-		};
+			const float * const texel = &hdr_data[((size_t)y * hdr_env.xres + x) * 3];
+			hdr_env.image.set(x, y, { texel[0], texel[1], texel[2] });
+		}
+		stbi_image_free(hdr_data);
+
+		// Build the importance sampling distribution once, shared by all render threads
+		hdr_env.buildDistribution();
+		hdr_env.buildIrradianceSH();
+
+		if (cubemap_res >= 0)
+			hdr_env.buildCubeMap(HDREnvironment::cubeMapResolution(cubemap_res, hdr_env.xres));
+
+		if (!hdr_env.writeCache(cache_path, source_stamp))
+			fprintf(stderr, "Failed to write environment cache: %s\n", cache_path.c_str());
+	}
+	hdr_env.rough_lod = rough_lod;
+
+	const double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+	printf("Loaded HDR environment map: %s (%d x %d) in %.3f seconds%s\n", path.c_str(), hdr_env.xres, hdr_env.yres, seconds, cached ? " from cache" : "");
+	if (!hdr_env.cube_mips.empty())
+		printf("Environment cube map: %d x %d x 6 with %d mip levels\n", hdr_env.cube_res, hdr_env.cube_res, (int)hdr_env.cube_mips.size());
+	printf("Environment texel storage: %s, %.1f MB\n", packed ? "RGB9E5" : "float", hdr_env.memoryUsage() / (1024.0 * 1024.0));
+	return true;
+}
+
+
+// Measures the cost of a pass so we can schedule as many passes as will fit before a deadline
+struct PassTimer
+{
+	double seconds_per_pass = 0; // Zero until a complete pass has been timed
+
+	void update(const int passes, const double seconds) noexcept { if (passes > 0) seconds_per_pass = seconds / passes; }
+
+	int passesBefore(const Clock::time_point deadline, const int max_passes) const noexcept
+	{
+		if (deadline == Clock::time_point::max()) return max_passes;
+		if (seconds_per_pass <= 0) return std::min(1, max_passes); // Time a single pass first
+
+		const double remaining = std::chrono::duration<double>(deadline - Clock::now()).count();
+		return std::max(1, std::min(max_passes, (int)(remaining / seconds_per_pass)));
+	}
+};
+
+
+// The HDR buffer is in the output's pixel order, and normalised by its per-pixel sample counts unless it already is.
+// Each row of a bucket is contiguous, so we tonemap a row of the image one bucket at a time.
+void tonemap(std::vector<sRGBPixel> & image_LDR, const std::vector<vec3f> & image_HDR, const RenderOutput & output, const bool normalise,
+	const TonemapSettings & settings = TonemapSettings()) noexcept
+{
+	const int xres = output.xres;
+	#pragma omp parallel for
+	for (int y = 0; y < output.yres; y++)
+	for (int x = 0; x < xres; x += bucket_size)
+	{
+		const int i = output.pixelIndex(x, y);
+		tonemapRow(&image_LDR[(size_t)y * xres + x].r, &image_HDR[i], normalise ? &output.samples[i] : nullptr, std::min(bucket_size, xres - x), settings);
 	}
 }
 
@@ -108,11 +195,36 @@ int main(int argc, char ** argv)
 	const bool print_timing = true;
 
 	// Parse command line arguments
-	enum { mode_progressive, mode_animation } mode = mode_progressive;
+	enum { mode_progressive, mode_animation, mode_tiled } mode = mode_progressive;
 	bool preview = false;
 	bool box = false;
 	bool save_normal = false;
 	bool save_albedo = false;
+	bool save_error  = false;
+	bool denoise     = false;
+	bool use_guiding = false;
+	bool use_radiance_cache = false;
+	bool save_exr    = false; // Also save all the AOVs unclamped in one OpenEXR file
+	bool png_bench   = false; // Compare the PNG writer against stb_image_write on every image saved
+	bool half_aovs   = false; // Accumulate the normal, albedo and depth at half precision
+	bool multires    = false; // Start progressive renders with quick passes at lower resolutions
+	EXRPixelType exr_pixel_type = exr_half;
+	EXRCompression exr_compression = exr_zip;
+	VideoOutput video_output = video_ffmpeg; // How animation frames are saved
+	float adaptive_threshold = 0; // Relative error for adaptive sampling, zero to disable
+	TonemapSettings tonemap_settings; // For the beauty and denoised images
+	RenderSettings settings;
+	Camera camera;
+	double time_budget = 0; // Seconds, zero for a fixed number of passes
+	int pass_count = 0; // Passes per frame or tile, or the maximum for progressive renders, zero for the default of each mode
+	int tile_size = 0;
+	int resolution_x = 0, resolution_y = 0; // Zero for the default of each mode
+	double checkpoint_interval = 0; // Seconds between checkpoints of progressive renders, zero to disable
+	bool resume = false;
+	int num_sphere_lights = 0;
+	int cubemap_res = -1; // Cube map face resolution, zero to derive from the environment map, negative to sample the lat-long map
+	int env_rough_lod = 0;
+	bool env_packed = false; // Store the environment as RGB9E5 instead of float RGB
 	std::string formula_name = "mandalay";
 	std::string hdrenv_path;
 	for (int arg = 1; arg < argc; ++arg)
@@ -123,32 +235,115 @@ int main(int argc, char ** argv)
 		else if (a == "--box")     box = true;
 		else if (a == "--normal")  save_normal = true;
 		else if (a == "--albedo")  save_albedo = true;
+		else if (a == "--error")   save_error  = true;
+		else if (a == "--denoise") denoise     = true;
+		else if (a == "--guiding") use_guiding = true;
+		else if (a == "--adjointrr") settings.adjoint_rr = true;
+		else if (a == "--nodof")     camera.lens_radius = 0;
+		else if (a == "--nomotionblur") camera.shutter = 0;
+		else if (a == "--radiancecache") use_radiance_cache = true;
+		else if (a == "--pngbench")  png_bench = true;
+		else if (a == "--halfaovs")  half_aovs = true;
+		else if (a == "--multires")  multires  = true;
+		else if (a == "--filmic")    tonemap_settings.curve = tonemap_filmic;
+		else if (a == "--exposure" && arg + 1 < argc) tonemap_settings.exposure = (float)atof(argv[++arg]);
 		else if (a == "--formula" && arg + 1 < argc) formula_name = argv[++arg];
 		else if (a == "--hdrenv"  && arg + 1 < argc) hdrenv_path  = argv[++arg];
-		else { fprintf(stderr, "Unknown argument: %s\nUsage: FractalTracer [--formula <name>] [--hdrenv <path>] [--animation] [--preview] [--box] [--normal] [--albedo]\n", argv[arg]); return 1; }
-	}
-
-	// Load HDR environment map if specified
-	HDREnvironment hdr_env;
-	if (!hdrenv_path.empty())
-	{
-		int channels;
-		float * hdr_data = stbi_loadf(hdrenv_path.c_str(), &hdr_env.xres, &hdr_env.yres, &channels, 3);
-		if (hdr_data == nullptr)
+		else if (a == "--time"    && arg + 1 < argc) time_budget  = atof(argv[++arg]);
+		else if (a == "--passes"  && arg + 1 < argc) pass_count   = atoi(argv[++arg]);
+		else if (a == "--tiled"   && arg + 1 < argc) { mode = mode_tiled; tile_size = std::max(1, atoi(argv[++arg])); }
+		else if (a == "--resolution" && arg + 2 < argc) { resolution_x = atoi(argv[++arg]); resolution_y = atoi(argv[++arg]); }
+		else if (a == "--checkpoint" && arg + 1 < argc) checkpoint_interval = atof(argv[++arg]);
+		else if (a == "--resume")  resume = true;
+		else if (a == "--adaptive" && arg + 1 < argc) adaptive_threshold = (float)atof(argv[++arg]);
+		else if (a == "--spherelights" && arg + 1 < argc) num_sphere_lights = atoi(argv[++arg]);
+		else if (a == "--cubemap" && arg + 1 < argc) cubemap_res   = atoi(argv[++arg]);
+		else if (a == "--envlod"  && arg + 1 < argc) env_rough_lod = atoi(argv[++arg]);
+		else if (a == "--shambient" && arg + 1 < argc) settings.sh_ambient_vertex = atoi(argv[++arg]);
+		else if (a == "--campos"   && arg + 3 < argc) { for (int i = 0; i < 3; ++i) camera.position.e[i] = atof(argv[++arg]); }
+		else if (a == "--lookat"   && arg + 3 < argc) { for (int i = 0; i < 3; ++i) camera.lookat.e[i]   = atof(argv[++arg]); }
+		else if (a == "--up"       && arg + 3 < argc) { for (int i = 0; i < 3; ++i) camera.world_up.e[i] = atof(argv[++arg]); }
+		else if (a == "--fov"      && arg + 1 < argc) camera.fov_deg     = atof(argv[++arg]);
+		else if (a == "--aperture" && arg + 1 < argc) camera.lens_radius = atof(argv[++arg]);
+		else if (a == "--focus"    && arg + 1 < argc) camera.focal_dist  = atof(argv[++arg]);
+		else if (a == "--shutter"  && arg + 1 < argc) camera.shutter     = atof(argv[++arg]);
+		else if (a == "--envstorage" && arg + 1 < argc)
+		{
+			const std::string storage_name = argv[++arg];
+			if      (storage_name == "float")  env_packed = false;
+			else if (storage_name == "rgb9e5") env_packed = true;
+			else { fprintf(stderr, "Unknown environment storage: %s\nAvailable storage formats: float, rgb9e5\n", storage_name.c_str()); return 1; }
+		}
+		else if (a == "--exr" && arg + 1 < argc)
 		{
-			fprintf(stderr, "Failed to load HDR environment map: %s\n", hdrenv_path.c_str());
-			return 1;
+			const std::string exr_type_name = argv[++arg];
+			save_exr = true;
+			if      (exr_type_name == "half")  exr_pixel_type = exr_half;
+			else if (exr_type_name == "float") exr_pixel_type = exr_float;
+			else { fprintf(stderr, "Unknown EXR pixel type: %s\nAvailable pixel types: half, float\n", exr_type_name.c_str()); return 1; }
 		}
+		else if (a == "--exrcompression" && arg + 1 < argc)
+		{
+			const std::string exr_compression_name = argv[++arg];
+			if      (exr_compression_name == "none") exr_compression = exr_uncompressed;
+			else if (exr_compression_name == "zip")  exr_compression = exr_zip;
+			else { fprintf(stderr, "Unknown EXR compression: %s\nAvailable compression: none, zip\n", exr_compression_name.c_str()); return 1; }
+		}
+		else if (a == "--video" && arg + 1 < argc)
+		{
+			const std::string video_name = argv[++arg];
+			if      (video_name == "ffmpeg") video_output = video_ffmpeg;
+			else if (video_name == "y4m")    video_output = video_y4m;
+			else if (video_name == "png")    video_output = video_png;
+			else { fprintf(stderr, "Unknown video output: %s\nAvailable video outputs: ffmpeg, y4m, png\n", video_name.c_str()); return 1; }
+		}
+		else if (a == "--integrator" && arg + 1 < argc)
+		{
+			const std::string integrator_name = argv[++arg];
+			if      (integrator_name == "path")   settings.integrator = integrator_path;
+			else if (integrator_name == "direct") settings.integrator = integrator_direct;
+			else if (integrator_name == "ao")     settings.integrator = integrator_ao;
+			else if (integrator_name == "aov")    settings.integrator = integrator_aov;
+			else { fprintf(stderr, "Unknown integrator: %s\nAvailable integrators: path, direct, ao, aov\n", integrator_name.c_str()); return 1; }
+		}
+		else if (a == "--sampler" && arg + 1 < argc)
+		{
+			const std::string sampler_name = argv[++arg];
+			if      (sampler_name == "sobol")   settings.sampler = sampler_sobol;
+			else if (sampler_name == "radical") settings.sampler = sampler_radical_inverse;
+			else { fprintf(stderr, "Unknown sampler: %s\nAvailable samplers: sobol, radical\n", sampler_name.c_str()); return 1; }
+		}
+		else { fprintf(stderr, "Unknown argument: %s\nUsage: FractalTracer [--formula <name>] [--hdrenv <path>] [--time <seconds>] [--passes <count>] [--checkpoint <seconds>] [--resume] [--tiled <tile size>] [--resolution <width> <height>] [--adaptive <error>] [--integrator <path|direct|ao|aov>] [--sampler <sobol|radical>] [--spherelights <count>] [--cubemap <face res>] [--envlod <level>] [--shambient <vertex>] [--envstorage <float|rgb9e5>] [--exposure <stops>] [--filmic] [--exr <half|float>] [--exrcompression <none|zip>] [--video <ffmpeg|y4m|png>] [--animation] [--preview] [--multires] [--box] [--normal] [--albedo] [--error] [--denoise] [--guiding] [--adjointrr] [--radiancecache] [--pngbench] [--halfaovs] [--campos <x y z>] [--lookat <x y z>] [--up <x y z>] [--fov <degrees>] [--aperture <radius>] [--focus <distance>] [--shutter <fraction>] [--nodof] [--nomotionblur]\n", argv[arg]); return 1; }
+	}
 
-		hdr_env.data.resize(hdr_env.xres * hdr_env.yres);
-		for (int i = 0; i < hdr_env.xres * hdr_env.yres; ++i)
-			hdr_env.data[i] = { hdr_data[i * 3 + 0], hdr_data[i * 3 + 1], hdr_data[i * 3 + 2] };
+	// Path guiding and the radiance cache learn from the whole render so far, which checkpoints don't keep, so a resumed
+	//  render couldn't match an uninterrupted one
+	if (resume && (use_guiding || use_radiance_cache))
+	{
+		fprintf(stderr, "Can't resume with --guiding or --radiancecache, checkpoints don't save what they've learned\n");
+		return 1;
+	}
 
-		stbi_image_free(hdr_data);
-		printf("Loaded HDR environment map: %s (%d x %d)\n", hdrenv_path.c_str(), hdr_env.xres, hdr_env.yres);
+	// Identify the render by the options that affect the image, so we only resume checkpoints of the same render (FNV-1a)
+	uint64_t settings_hash = 0xCBF29CE484222325ull;
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		const std::string a = argv[arg];
+		if (a == "--resume") continue;
+		if (a == "--checkpoint" || a == "--time") { ++arg; continue; }
+		for (const char c : a + '\0')
+			settings_hash = (settings_hash ^ (uint8_t)c) * 0x100000001B3ull;
 	}
 
+	// Load the HDR environment map on a background thread, overlapping with setting up the scene and output buffers
+	HDREnvironment hdr_env;
+	std::future<bool> hdr_env_loaded = std::async(std::launch::async, [&]()
+	{
+		return hdrenv_path.empty() || loadEnvironment(hdr_env, hdrenv_path, env_packed, cubemap_res, env_rough_lod);
+	});
+
 	Scene scene;
+	scene.camera = camera;
 	{
 		const real main_sphere_rad = 1.35f;
 
@@ -290,8 +485,7 @@ int main(int argc, char ** argv)
 			hybrid.mat.colouring = new OrbitTrapColouring();
 			scene.objects.push_back(hybrid.clone());
 		}
-		// Test adding sphere lights
-		const int num_sphere_lights = 0;//1 << 5;
+		// Test adding sphere lights, e.g. 1 << 5
 		for (int i = 0; i < num_sphere_lights; ++i)
 		{
 			const real offset = 0.61803398874989484820458683436564f;
@@ -316,26 +510,247 @@ int main(int argc, char ** argv)
 			sp.mat.emission = 4;
 			scene.objects.push_back(sp.clone());
 		}
+
+		scene.update();
 	}
 	const int image_div = preview ? 4 : 1;
 	const int image_multi  = mode == mode_animation ? 40 : 80 * 2;
-	const int image_width  = image_multi / image_div * 16;
-	const int image_height = image_multi / image_div * 9;
-	std::vector<sRGBPixel> image_LDR(image_width * image_height);
-	RenderOutput output(image_width, image_height);
+	const int image_width  = (resolution_x > 0) ? resolution_x : image_multi / image_div * 16;
+	const int image_height = (resolution_y > 0) ? resolution_y : image_multi / image_div * 9;
+
+	// Only accumulate the AOVs that something is going to use, the EXR file (always written by tiled renders) has them all
+	const bool full_image = mode != mode_tiled;
+	const bool all_aovs = save_exr || denoise || !full_image;
+	const int aovs =
+		((all_aovs || save_normal) ? aov_normal : 0) |
+		((all_aovs || save_albedo) ? aov_albedo : 0) |
+		(all_aovs ? aov_depth : 0) |
+		((denoise || save_error || adaptive_threshold > 0) ? aov_variance : 0) |
+		(half_aovs ? aov_half : 0);
+
+	// Tiled renders only allocate buffers for the tile being rendered, so that the memory used doesn't depend on the resolution
+	std::vector<sRGBPixel> image_LDR(full_image ? image_width * image_height : 0);
+	RenderOutput output(full_image ? image_width : 0, full_image ? image_height : 0, aovs);
 
 	std::vector<std::thread> threads(num_threads);
 
-	const auto save_tonemapped_buffer = [&](const char * channel_name, const int frame, const int passes, const std::vector<vec3f> & buffer)
+	// Animation frames are streamed to a video per channel rather than saved as PNGs, the streams are opened on the first frame
+	constexpr int video_fps = 30;
+	std::vector<std::pair<std::string, std::unique_ptr<VideoStream>>> video_streams;
+	const auto video_stream = [&](const char * channel_name) -> VideoStream *
+	{
+		for (const auto & [name, stream] : video_streams)
+			if (name == channel_name)
+				return stream.get();
+
+		video_streams.emplace_back(channel_name, std::make_unique<VideoStream>());
+		VideoStream * const stream = video_streams.back().second.get();
+		if (!stream->open(channel_name, video_output, image_width, image_height, video_fps))
+			fprintf(stderr, "Failed to open video output %s\n", stream->path.c_str());
+		return stream;
+	};
+
+	const auto save_tonemapped_buffer = [&](const char * channel_name, const int frame, const std::vector<vec3f> & buffer, const bool normalise = true,
+		const TonemapSettings & settings = TonemapSettings())
 	{
 		// Tonemap and convert to LDR sRGB
-		tonemap(image_LDR, buffer, passes, image_width, image_height);
+		tonemap(image_LDR, buffer, output, normalise, settings);
+
+		if (mode == mode_animation && video_output != video_png)
+		{
+			VideoStream * const stream = video_stream(channel_name);
+			if (!stream->writeFrame(&image_LDR[0].r))
+				fprintf(stderr, "Failed to write frame %d to %s\n", frame, stream->path.c_str());
+			else
+				printf("Streamed frame %d to %s with %.2f samples per pixel\n", frame, stream->path.c_str(), output.averageSamples());
+			return;
+		}
 
 		// Save frame
 		char filename[128];
 		snprintf(filename, 128, "%s_frame_%08d.png", channel_name, frame);
-		stbi_write_png(filename, image_width, image_height, 3, &image_LDR[0], image_width * 3);
-		printf("Saved %s with %d passes\n", filename, passes);
+		const auto t0 = Clock::now();
+		if (!writePNG(filename, image_width, image_height, &image_LDR[0].r))
+			fprintf(stderr, "Failed to write %s\n", filename);
+		printf("Saved %s with %.2f samples per pixel\n", filename, output.averageSamples());
+
+		if (png_bench)
+		{
+			const auto t1 = Clock::now();
+			int stb_size = 0;
+			unsigned char * const stb_png = stbi_write_png_to_mem(&image_LDR[0].r, image_width * 3, image_width, image_height, 3, &stb_size);
+			const auto t2 = Clock::now();
+			STBIW_FREE(stb_png);
+
+			std::error_code ec;
+			printf("PNG encode: %.1f ms for %.3f MB, stb_image_write %.1f ms for %.3f MB\n",
+				std::chrono::duration<double>(t1 - t0).count() * 1000, std::filesystem::file_size(filename, ec) / (1024.0 * 1024.0),
+				std::chrono::duration<double>(t2 - t1).count() * 1000, stb_size / (1024.0 * 1024.0));
+		}
+	};
+
+	// Normalised normal or albedo AOV
+	std::vector<vec3f> aov_buffer;
+	const auto save_aov_buffer = [&](const char * channel_name, const int frame, vec3f (RenderOutput::* const mean)(int) const noexcept)
+	{
+		aov_buffer.resize(image_width * image_height);
+		#pragma omp parallel for
+		for (int i = 0; i < image_width * image_height; ++i)
+			aov_buffer[i] = (output.*mean)(i);
+		save_tonemapped_buffer(channel_name, frame, aov_buffer, false);
+	};
+
+	// Per-pixel relative error map, mostly useful for tuning adaptive sampling
+	std::vector<vec3f> error_buffer;
+	const auto save_error_buffer = [&](const int frame)
+	{
+		error_buffer.resize(image_width * image_height);
+		#pragma omp parallel for
+		for (int i = 0; i < image_width * image_height; ++i)
+			error_buffer[i] = std::min(1.0f, output.relativeError(i));
+		save_tonemapped_buffer("error", frame, error_buffer, false);
+	};
+
+	// Denoised beauty, saved alongside the noisy one
+	Denoiser denoiser;
+	std::vector<vec3f> denoised_buffer;
+	const auto save_denoised_buffer = [&](const int frame)
+	{
+		const auto t0 = Clock::now();
+		denoiser.denoise(output, denoised_buffer);
+		if (print_timing)
+			printf("Denoising took %.3f seconds\n", std::chrono::duration<double>(Clock::now() - t0).count());
+		save_tonemapped_buffer("denoised", frame, denoised_buffer, false, tonemap_settings);
+	};
+
+	// Beauty and AOVs as layers of one EXR file in scanline order, normalised but otherwise unprocessed.
+	// The denoised beauty is included if given, in the image's pixel order like the other buffers.
+	std::vector<float> exr_buffer;
+	const auto exr_channels = [&](const RenderOutput & image, const std::vector<vec3f> * const denoised = nullptr) -> std::vector<EXRChannel>
+	{
+		const int num_values = (denoised) ? 13 : 10;
+		const int num_pixels = image.xres * image.yres;
+
+		exr_buffer.resize((size_t)num_pixels * num_values);
+		#pragma omp parallel for
+		for (int y = 0; y < image.yres; ++y)
+		for (int x = 0; x < image.xres; ++x)
+		{
+			const int p = image.pixelIndex(x, y);
+			const int n = image.samples[p];
+			const float depth = image.depthMean(p);
+			const vec3f beauty = (n > 0) ? image.beauty[p] * (1.0f / n) : vec3f(0);
+			const vec3f albedo = image.albedoMean(p);
+
+			// Decode the normal to [-1, 1] and undo the Y and Z swap, misses have no normal
+			const vec3f normal = (depth > 0) ? image.normalMean(p) * 2 - 1 : vec3f(0);
+
+			float * const v = &exr_buffer[((size_t)y * image.xres + x) * num_values];
+			v[0] = beauty.x(); v[1] = beauty.y(); v[2] = beauty.z();
+			v[3] = albedo.x(); v[4] = albedo.y(); v[5] = albedo.z();
+			v[6] = normal.x(); v[7] = normal.z(); v[8] = normal.y();
+			v[9] = depth;
+			if (denoised)
+			{
+				const vec3f d = (*denoised)[p];
+				v[10] = d.x(); v[11] = d.y(); v[12] = d.z();
+			}
+		}
+
+		const float * const v = exr_buffer.data();
+		std::vector<EXRChannel> channels =
+		{
+			{ "R", v + 0, num_values }, { "G", v + 1, num_values }, { "B", v + 2, num_values },
+			{ "albedo.R", v + 3, num_values }, { "albedo.G", v + 4, num_values }, { "albedo.B", v + 5, num_values },
+			{ "normal.X", v + 6, num_values }, { "normal.Y", v + 7, num_values }, { "normal.Z", v + 8, num_values },
+			{ "depth.Z",  v + 9, num_values }
+		};
+		if (denoised)
+		{
+			channels.push_back({ "denoised.R", v + 10, num_values });
+			channels.push_back({ "denoised.G", v + 11, num_values });
+			channels.push_back({ "denoised.B", v + 12, num_values });
+		}
+		return channels;
+	};
+
+	const auto save_exr_file = [&](const int frame)
+	{
+		const int num_pixels = image_width * image_height;
+		const auto t0 = Clock::now();
+
+		const bool has_denoised = denoise && (int)denoised_buffer.size() == num_pixels;
+		const std::vector<EXRChannel> channels = exr_channels(output, has_denoised ? &denoised_buffer : nullptr);
+
+		char filename[128];
+		snprintf(filename, 128, "render_frame_%08d.exr", frame);
+		if (!writeEXR(filename, image_width, image_height, channels, exr_pixel_type, exr_compression))
+			fprintf(stderr, "Failed to write %s\n", filename);
+		else if (print_timing)
+			printf("Saved %s in %.3f seconds\n", filename, std::chrono::duration<double>(Clock::now() - t0).count());
+	};
+
+	// Path guiding learns across passes (and frames), the scene fits comfortably in this box
+	std::unique_ptr<PathGuiding> guiding;
+	if (use_guiding)
+		guiding = std::make_unique<PathGuiding>(vec3f(-2), vec3f(2));
+
+	// The radiance cache also carries over between frames, since only the camera moves
+	std::unique_ptr<RadianceCache> radiance_cache;
+	if (use_radiance_cache)
+		radiance_cache = std::make_unique<RadianceCache>();
+
+	std::unique_ptr<AdaptiveSampling> adaptive;
+	if (adaptive_threshold > 0 && full_image)
+		adaptive = std::make_unique<AdaptiveSampling>(adaptive_threshold, output);
+
+	if (!hdr_env_loaded.get())
+		return 1;
+
+	// Checkpoints are copied between passes and written on another thread while rendering carries on
+	const char * const checkpoint_path = "render.checkpoint";
+	RenderCheckpoint checkpoint;
+	checkpoint.settings_hash = settings_hash;
+	std::future<bool> checkpoint_written;
+	Clock::time_point next_checkpoint = Clock::time_point::max();
+	const auto write_checkpoint = [&](const int pass, const int target_passes)
+	{
+		if (checkpoint_written.valid() && !checkpoint_written.get())
+			fprintf(stderr, "Failed to write %s\n", checkpoint_path);
+
+		checkpoint.capture(output, adaptive.get(), pass, target_passes);
+		checkpoint_written = std::async(std::launch::async, [&]() { return checkpoint.write(checkpoint_path); });
+		next_checkpoint = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(checkpoint_interval));
+	};
+
+	// With a time budget we render the best image we can before the deadline rather than a fixed number of passes
+	const Clock::time_point deadline = (time_budget > 0) ?
+		Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_budget)) :
+		Clock::time_point::max();
+	PassTimer pass_timer;
+
+	// Render up to the given number of passes, in rounds when adaptive sampling needs to update the convergence estimate in between
+	const auto render_image = [&](RenderOutput & image, AdaptiveSampling * const image_adaptive, const int frame, const int frames,
+		const int passes, const Clock::time_point image_deadline)
+	{
+		int pass = 0;
+		while (pass < passes)
+		{
+			const auto p1 = std::chrono::steady_clock::now();
+			const int max_round_passes = (image_adaptive) ? std::max(pass, 1) : passes - pass;
+			const int num_passes = pass_timer.passesBefore(image_deadline, std::min(max_round_passes, passes - pass));
+			const bool completed = renderPasses(threads, image, frame, pass, num_passes, frames, scene, &hdr_env, settings, image_deadline, image_adaptive, guiding.get(), radiance_cache.get());
+			if (guiding) guiding->refresh();
+			if (!completed)
+				break;
+
+			const auto p2 = std::chrono::steady_clock::now();
+			pass_timer.update(num_passes, std::chrono::duration_cast<std::chrono::duration<double>>(p2 - p1).count());
+			pass += num_passes;
+
+			if (image_adaptive && image_adaptive->update(image) == 0)
+				break;
+		}
 	};
 
 	switch (mode)
@@ -343,16 +758,29 @@ int main(int argc, char ** argv)
 		case mode_animation:
 		{
 			const int frames = preview ? 30 : 30 * 4;
-			const int passes = preview ? 1 : 2 * 3; // 2 * 3 * 5 * 7;
-			printf("Rendering %d frames at resolution %d x %d with %d passes\n", frames, image_width, image_height, passes);
+			if (video_output == video_ffmpeg && !ffmpegAvailable())
+			{
+				printf("ffmpeg not found, writing uncompressed y4m video instead\n");
+				video_output = video_y4m;
+			}
+
+			const int passes = (pass_count > 0) ? pass_count : (time_budget > 0) ? 1 << 16 : preview ? 1 : 2 * 3; // 2 * 3 * 5 * 7;
+			if (time_budget > 0)
+				printf("Rendering %d frames at resolution %d x %d in %.1f seconds\n", frames, image_width, image_height, time_budget);
+			else
+				printf("Rendering %d frames at resolution %d x %d with %d passes\n", frames, image_width, image_height, passes);
 
 			for (int frame = 0; frame < frames; ++frame)
 			{
 				output.clear();
+				if (adaptive) adaptive->reset(output);
 
 				const auto t1 = std::chrono::steady_clock::now();
 
-				renderPasses(threads, output, frame, 0, passes, frames, scene, &hdr_env);
+				// Share the remaining time equally between the remaining frames
+				const Clock::time_point frame_deadline = (time_budget > 0) ? t1 + (deadline - t1) / (frames - frame) : deadline;
+
+				render_image(output, adaptive.get(), frame, frames, passes, frame_deadline);
 
 				if (print_timing)
 				{
@@ -361,11 +789,23 @@ int main(int argc, char ** argv)
 					printf("Frame took %.2f seconds to render.\n", time_span.count());
 				}
 
-				save_tonemapped_buffer("beauty", frame, passes, output.beauty);
-				if (save_normal) save_tonemapped_buffer("normal", frame, passes, output.normal);
-				if (save_albedo) save_tonemapped_buffer("albedo", frame, passes, output.albedo);
+				save_tonemapped_buffer("beauty", frame, output.beauty, true, tonemap_settings);
+				if (save_normal) save_aov_buffer("normal", frame, &RenderOutput::normalMean);
+				if (save_albedo) save_aov_buffer("albedo", frame, &RenderOutput::albedoMean);
+				if (save_error)  save_error_buffer(frame);
+				if (denoise)     save_denoised_buffer(frame);
+				if (save_exr)    save_exr_file(frame);
 			}
 
+			// Finish the streamed videos, which waits for the encoder
+			for (const auto & [name, stream] : video_streams)
+				if (!stream->close())
+					fprintf(stderr, "Failed to finish %s\n", stream->path.c_str());
+				else
+					printf("Saved %s\n", stream->path.c_str());
+			if (video_output != video_png)
+				break;
+
 			// Encode PNG sequences to MP4 using ffmpeg
 			const auto encode_video = [](const char * channel_name)
 			{
@@ -382,41 +822,248 @@ int main(int argc, char ** argv)
 			encode_video("beauty");
 			if (save_normal) encode_video("normal");
 			if (save_albedo) encode_video("albedo");
+			if (denoise)     encode_video("denoised");
 
 			break;
 		}
 
 		case mode_progressive:
 		{
-			const int max_passes = 2 * 3 * 5 * 7 * 11; // Set a reasonable max number of passes instead of going forever
-			printf("Progressive rendering at resolution %d x %d with doubling passes to max %d\n", image_width, image_height, max_passes);
+			// Set a reasonable max number of passes instead of going forever, unless we're limited by time
+			const int max_passes = (pass_count > 0) ? pass_count : (time_budget > 0) ? 1 << 24 : 2 * 3 * 5 * 7 * 11;
+			if (time_budget > 0)
+				printf("Progressive rendering at resolution %d x %d with doubling passes for %.1f seconds\n", image_width, image_height, time_budget);
+			else
+				printf("Progressive rendering at resolution %d x %d with doubling passes to max %d\n", image_width, image_height, max_passes);
 			output.clear();
 
 			int pass = 0;
 			int target_passes = 1;
+			if (resume)
+			{
+				if (!checkpoint.read(checkpoint_path, settings_hash, output))
+				{
+					fprintf(stderr, "Can't resume from %s, it's missing or was written by a render with different options\n", checkpoint_path);
+					return 1;
+				}
+				checkpoint.restore(output, adaptive.get());
+				pass = checkpoint.pass;
+				target_passes = checkpoint.target_passes;
+				printf("Resuming from %s after %d passes\n", checkpoint_path, pass);
+			}
+
+			// Multi-resolution start: a pass at 1/16 and then 1/4 of the resolution, each upsampled and saved as a preview of the
+			//  beauty within moments. Each level also works out how far the camera rays of the next can skip ahead, which the
+			//  full resolution passes keep using. Resumed renders only need that part.
+			std::unique_ptr<StartDistanceGrid> start_distances;
+			if (multires)
+			{
+				std::vector<vec3f> preview_buffer(image_width * image_height);
+				std::unique_ptr<StartDistanceGrid> coarser;
+				for (const int scale : { 16, 4, 1 })
+				{
+					const auto t1 = Clock::now();
+					const int level_xres = (image_width  + scale - 1) / scale;
+					const int level_yres = (image_height + scale - 1) / scale;
+					std::unique_ptr<StartDistanceGrid> grid = std::make_unique<StartDistanceGrid>();
+					if (!grid->build(scene, image_width, image_height, scale, coarser.get()))
+					{
+						printf("Not all objects have distance estimates, camera rays can't skip ahead\n");
+						grid.reset();
+					}
+
+					if (scale == 1)
+					{
+						if (print_timing && grid)
+							printf("Camera ray start distances took %.3f seconds\n", std::chrono::duration<double>(Clock::now() - t1).count());
+						start_distances = std::move(grid);
+						break;
+					}
+					if (resume)
+					{
+						coarser = std::move(grid);
+						continue;
+					}
+
+					// Same view as the full resolution, with the last row and column of coarse pixels reaching past its edges
+					RenderOutput level_output(level_xres, level_yres, 0);
+					level_output.image_xres = image_width;
+					level_output.image_yres = image_height;
+					level_output.pixel_scale = scale;
+					level_output.clear();
+					renderPasses(threads, level_output, 0, 0, 1, 0, scene, &hdr_env, settings, deadline, nullptr, nullptr, nullptr, grid.get());
+
+					// Bilinear upsampling of the normalised level
+					#pragma omp parallel for
+					for (int y = 0; y < image_height; ++y)
+					for (int x = 0; x < image_width; ++x)
+					{
+						const float u = std::max(0.0f, (x + 0.5f) / scale - 0.5f);
+						const float v = std::max(0.0f, (y + 0.5f) / scale - 0.5f);
+						const int x0 = std::min((int)u, level_xres - 1), x1 = std::min(x0 + 1, level_xres - 1);
+						const int y0 = std::min((int)v, level_yres - 1), y1 = std::min(y0 + 1, level_yres - 1);
+						const float fx = u - (int)u, fy = v - (int)v;
+						const auto texel = [&](const int tx, const int ty)
+						{
+							const int i = level_output.pixelIndex(tx, ty);
+							return (level_output.samples[i] > 0) ? level_output.beauty[i] * (1.0f / level_output.samples[i]) : vec3f(0);
+						};
+						preview_buffer[output.pixelIndex(x, y)] =
+							(texel(x0, y0) * (1 - fx) + texel(x1, y0) * fx) * (1 - fy) +
+							(texel(x0, y1) * (1 - fx) + texel(x1, y1) * fx) * fy;
+					}
+
+					if (print_timing)
+						printf("1/%d resolution pass (%d x %d) took %.3f seconds\n", scale, level_xres, level_yres, std::chrono::duration<double>(Clock::now() - t1).count());
+					save_tonemapped_buffer("beauty", 0, preview_buffer, false, tonemap_settings);
+					coarser = std::move(grid);
+				}
+			}
+
+			// Render a round of passes, split up to write checkpoints along the way. This doesn't change the result since
+			//  guiding and adaptive sampling are only updated between rounds. If the deadline cancels the round,
+			//  num_passes is reduced to the number of passes that were started.
+			if (checkpoint_interval > 0)
+				next_checkpoint = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(checkpoint_interval));
+			const auto render_round = [&](const int base_pass, int & num_passes) -> bool
+			{
+				int done = 0;
+				while (true)
+				{
+					// Note that we force num_frames to be zero since we usually don't want motion blur for stills
+					const int chunk = pass_timer.passesBefore(next_checkpoint, num_passes - done);
+					if (!renderPasses(threads, output, 0, base_pass + done, chunk, 0, scene, &hdr_env, settings, deadline, adaptive.get(), guiding.get(), radiance_cache.get(), start_distances.get()))
+					{
+						num_passes = done + chunk;
+						return false;
+					}
+
+					done += chunk;
+					if (done == num_passes)
+						return true;
+					write_checkpoint(base_pass + done, target_passes);
+				}
+			};
+
 			while (pass < max_passes)
 			{
 				const auto t1 = std::chrono::steady_clock::now();
 
-				// Note that we force num_frames to be zero since we usually don't want motion blur for stills
-				const int num_passes = target_passes - pass;
-				renderPasses(threads, output, 0, pass, num_passes, 0, scene, &hdr_env);
+				int num_passes = pass_timer.passesBefore(deadline, target_passes - pass);
+				const bool completed = render_round(pass, num_passes);
+				if (guiding) guiding->refresh(); // Each round of passes is one training iteration
+
+				const auto t2 = std::chrono::steady_clock::now();
+				const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+				if (completed)
+					pass_timer.update(num_passes, time_span.count());
 
 				if (print_timing)
 				{
-					const auto t2 = std::chrono::steady_clock::now();
-					const auto time_span = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-					printf("%d passes took %.2f seconds (%.2f seconds per pass).\n", num_passes, time_span.count(), time_span.count() / num_passes);
+					if (completed)
+						printf("%d passes took %.2f seconds (%.2f seconds per pass).\n", num_passes, time_span.count(), time_span.count() / num_passes);
+					else
+						printf("Deadline reached after %.2f seconds, last pass partially completed.\n", time_span.count());
 				}
 
-				save_tonemapped_buffer("beauty", 0, target_passes, output.beauty);
-				if (save_normal) save_tonemapped_buffer("normal", 0, target_passes, output.normal);
-				if (save_albedo) save_tonemapped_buffer("albedo", 0, target_passes, output.albedo);
+				// Stop sampling converged pixels, and stop entirely once everything has converged
+				const float active_fraction = (adaptive) ? adaptive->update(output) : 1.0f;
+				if (adaptive && print_timing)
+					printf("%.1f%% of pixels still active.\n", active_fraction * 100);
+
+				// Save on every doubling of the pass count, and when time runs out
+				pass += num_passes;
+				const bool out_of_time = !completed || t2 >= deadline;
+				const bool finished = out_of_time || active_fraction == 0;
+				if (pass == target_passes || finished)
+				{
+					save_tonemapped_buffer("beauty", 0, output.beauty, true, tonemap_settings);
+					if (save_normal) save_aov_buffer("normal", 0, &RenderOutput::normalMean);
+					if (save_albedo) save_aov_buffer("albedo", 0, &RenderOutput::albedoMean);
+					if (save_error)  save_error_buffer(0);
+					if (denoise)     save_denoised_buffer(0);
+					if (save_exr)    save_exr_file(0);
+				}
+
+				if (pass == target_passes && !finished)
+					target_passes = std::min(target_passes << 1, max_passes);
+				if (checkpoint_interval > 0 && (finished || Clock::now() >= next_checkpoint))
+					write_checkpoint(pass, target_passes);
+				if (finished)
+					break;
+			}
+
+			if (checkpoint_written.valid() && !checkpoint_written.get())
+				fprintf(stderr, "Failed to write %s\n", checkpoint_path);
+
+			break;
+		}
+
+		case mode_tiled:
+		{
+			// Each tile is rendered to completion in its own buffers and written straight to a tiled EXR file.
+			// Path guiding and the radiance cache keep learning from one tile to the next, since they're in world space.
+			const int passes = (pass_count > 0) ? pass_count : (time_budget > 0) ? 1 << 16 : 64;
+			const int x_tiles = (image_width  + tile_size - 1) / tile_size;
+			const int y_tiles = (image_height + tile_size - 1) / tile_size;
+			const int num_tiles = x_tiles * y_tiles;
+			if (time_budget > 0)
+				printf("Rendering %d tiles of %d x %d at resolution %d x %d in %.1f seconds\n", num_tiles, tile_size, tile_size, image_width, image_height, time_budget);
+			else
+				printf("Rendering %d tiles of %d x %d at resolution %d x %d with %d passes\n", num_tiles, tile_size, tile_size, image_width, image_height, passes);
+			if (denoise || save_normal || save_albedo || save_error || checkpoint_interval > 0 || resume)
+				printf("Tiled renders only save the EXR file, ignoring PNG, denoising and checkpoint options\n");
+
+			const char * const filename = "render_frame_00000000.exr";
+			EXRTiledWriter exr_writer;
+			if (!exr_writer.open(filename, image_width, image_height, tile_size, exr_channels(RenderOutput(0, 0)), exr_pixel_type, exr_compression))
+			{
+				fprintf(stderr, "Failed to write %s\n", filename);
+				return 1;
+			}
+
+			const auto t1 = std::chrono::steady_clock::now();
+			for (int tile = 0; tile < num_tiles; ++tile)
+			{
+				const int tile_y = tile / x_tiles;
+				const int tile_x = tile - x_tiles * tile_y;
+				const int x0 = tile_x * tile_size;
+				const int y0 = tile_y * tile_size;
 
-				pass = target_passes;
-				target_passes = std::min(target_passes << 1, max_passes);
+				RenderOutput tile_output(std::min(tile_size, image_width - x0), std::min(tile_size, image_height - y0), aovs);
+				tile_output.x0 = x0;
+				tile_output.y0 = y0;
+				tile_output.image_xres = image_width;
+				tile_output.image_yres = image_height;
+				tile_output.clear();
+
+				std::unique_ptr<AdaptiveSampling> tile_adaptive;
+				if (adaptive_threshold > 0)
+					tile_adaptive = std::make_unique<AdaptiveSampling>(adaptive_threshold, tile_output);
+
+				// Share the remaining time equally between the remaining tiles
+				const auto t2 = std::chrono::steady_clock::now();
+				const Clock::time_point tile_deadline = (time_budget > 0) ? t2 + (deadline - t2) / (num_tiles - tile) : deadline;
+
+				render_image(tile_output, tile_adaptive.get(), 0, 0, passes, tile_deadline);
+
+				if (!exr_writer.writeTile(tile_x, tile_y, exr_channels(tile_output)))
+				{
+					fprintf(stderr, "Failed to write %s\n", filename);
+					return 1;
+				}
+
+				if (print_timing)
+					printf("Tile %d of %d took %.2f seconds with %.2f samples per pixel\n", tile + 1, num_tiles,
+						std::chrono::duration<double>(std::chrono::steady_clock::now() - t2).count(), tile_output.averageSamples());
 			}
 
+			if (!exr_writer.finish())
+			{
+				fprintf(stderr, "Failed to write %s\n", filename);
+				return 1;
+			}
+			printf("Saved %s in %.2f seconds\n", filename, std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count());
 			break;
 		}
 	}
@@ -2,19 +2,36 @@ add_library(TracerLib INTERFACE)
 target_include_directories(TracerLib INTERFACE .)
 target_sources(TracerLib INTERFACE
     maths/Dual.h
+    maths/half.h
     maths/real.h
     maths/triplex.h
     maths/vec.h
 
     util/stb_image.h
     util/stb_image_write.h
+    util/MappedFile.h
+    util/AtomicFile.h
+    util/RelaxedAtomic.h
+    util/EXRWriter.h
+    util/VideoStream.h
+    util/PNGWriter.h
 
+    renderer/BVH.h
+    renderer/Camera.h
+    renderer/Checkpoint.h
     renderer/ColouringFunction.h
+    renderer/Denoiser.h
+    renderer/EnvImage.h
     renderer/HDREnvironment.h
     renderer/Material.h
+    renderer/PathGuiding.h
+    renderer/RadianceCache.h
     renderer/Ray.h
     renderer/Renderer.h
+    renderer/Sampler.h
     renderer/Scene.h
+    renderer/StartDistanceGrid.h
+    renderer/Tonemap.h
 
     scene_objects/AnalyticDEObject.h
     scene_objects/DualDEObject.h
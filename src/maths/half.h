@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+
+// IEEE half precision conversions, used for compact framebuffers and EXR output.
+// With F16C these are single instructions, otherwise bit manipulation giving the same results for all non-NaN values.
+// Ref: float_to_half_fast3_rtne and half_to_float from https://gist.github.com/rygorous/2156668
+
+// Float to half with round to nearest even, overflow to infinity and NaNs kept as NaNs
+inline uint16_t floatToHalf(const float f) noexcept
+{
+#if defined(__F16C__)
+	return (uint16_t)_cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+	constexpr uint32_t f32_infinity = 255 << 23;
+	constexpr uint32_t f16_max = (127 + 16) << 23;
+	constexpr uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+
+	uint32_t u;
+	memcpy(&u, &f, 4);
+	const uint32_t sign = u & 0x80000000u;
+	u ^= sign;
+
+	uint16_t h;
+	if (u >= f16_max)
+		h = (u > f32_infinity) ? 0x7E00 : 0x7C00;
+	else if (u < (113 << 23))
+	{
+		// Half denormal or zero, align the 10 mantissa bits at the bottom with a float add which rounds for us
+		float v, magic;
+		memcpy(&v, &u, 4);
+		memcpy(&magic, &denorm_magic, 4);
+		v += magic;
+		memcpy(&u, &v, 4);
+		h = (uint16_t)(u - denorm_magic);
+	}
+	else
+	{
+		const uint32_t mantissa_odd = (u >> 13) & 1;
+		u += ((uint32_t)(15 - 127) << 23) + 0xFFF + mantissa_odd; // Rebias the exponent and round
+		h = (uint16_t)(u >> 13);
+	}
+	return h | (uint16_t)(sign >> 16);
+#endif
+}
+
+// Half to float is exact
+inline float halfToFloat(const uint16_t h) noexcept
+{
+#if defined(__F16C__)
+	return _cvtsh_ss(h);
+#else
+	constexpr uint32_t shifted_exp = 0x7C00 << 13;
+	constexpr uint32_t denorm_magic = 113 << 23;
+
+	uint32_t u = (uint32_t)(h & 0x7FFF) << 13;
+	const uint32_t exp = u & shifted_exp;
+	u += (uint32_t)(127 - 15) << 23; // Rebias the exponent
+
+	if (exp == shifted_exp)
+		u += (uint32_t)(128 - 16) << 23; // Infinity or NaN
+	else if (exp == 0)
+	{
+		// Zero or denormal, renormalise with a float subtract
+		float v, magic;
+		u += 1 << 23;
+		memcpy(&v, &u, 4);
+		memcpy(&magic, &denorm_magic, 4);
+		v -= magic;
+		memcpy(&u, &v, 4);
+	}
+
+	u |= (uint32_t)(h & 0x8000) << 16;
+	float f;
+	memcpy(&f, &u, 4);
+	return f;
+#endif
+}
@@ -135,6 +135,19 @@ constexpr vec<3, real_type> cross(const vec<3, real_type> & a, const vec<3, real
 }
 
 
+// Build an orthonormal basis (t, b, n) around unit vector n without branches or normalisation
+// Ref: "Building an Orthonormal Basis, Revisited", Duff et al. 2017 <https://jcgt.org/published/0006/01/01/>
+template<typename real_type>
+inline void orthonormalBasis(const vec<3, real_type> & n, vec<3, real_type> & t, vec<3, real_type> & b) noexcept
+{
+	const real_type sign = std::copysign((real_type)1, n.z());
+	const real_type a = -1 / (sign + n.z());
+	const real_type c = n.x() * n.y() * a;
+	t = vec<3, real_type>(1 + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+	b = vec<3, real_type>(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+
 using vec2i = vec<2, int>;
 using vec2r = vec<2, real>;
 using vec2f = vec<2, float>;
@@ -155,6 +168,9 @@ using DualVec3f = vec<3, Dual3f>;
 using DualVec3d = vec<3, Dual3d>;
 
 
+inline float luminance(const vec3f & c) noexcept { return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z(); }
+
+
 using vec4i = vec<4, int>;
 using vec4r = vec<4, real>;
 using vec4f = vec<4, float>;
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+
+#include "scene_objects/SceneObject.h"
+
+
+
+// Bounding volume hierarchy over the scene objects, split with the surface area heuristic.
+// The nodes are stored flat in depth-first order, so the first child of an interior node is the next node and only the
+//  second child needs an index. Objects refer to the scene by index, so the BVH stays valid for copies of the scene.
+// Ref: "Heuristics for Ray Tracing Using Space Subdivision", MacDonald and Booth 1990
+struct BVH
+{
+	struct Node
+	{
+		vec3r lo, hi;
+		int32_t offset; // Second child for interior nodes, first entry in object_indices for leaves
+		int32_t count;  // Number of objects in a leaf, zero for interior nodes
+	};
+
+	std::vector<Node> nodes;
+	std::vector<int> object_indices; // Bounded objects in leaf order
+	std::vector<int> unbounded;      // Objects without bounds, which are tested by every ray
+
+
+	void build(const std::vector<SceneObject *> & objects)
+	{
+		nodes.clear();
+		object_indices.clear();
+		unbounded.clear();
+
+		std::vector<Item> items;
+		for (int i = 0; i < (int)objects.size(); ++i)
+		{
+			Item item;
+			if (!objects[i]->getBounds(item.lo, item.hi))
+			{
+				unbounded.push_back(i);
+				continue;
+			}
+
+			// Pad the box so that rounding in the objects' intersection tests can't put hits outside it
+			const real pad = ray_epsilon + std::max(length(item.lo), length(item.hi)) * (real)1e-5;
+			item.lo -= pad;
+			item.hi += pad;
+			item.centroid = (item.lo + item.hi) * (real)0.5;
+			item.index = i;
+			items.push_back(item);
+		}
+
+		if (items.empty())
+			return;
+
+		nodes.reserve(items.size() * 2 - 1);
+		buildNode(items, 0, (int)items.size(), 0);
+
+		object_indices.resize(items.size());
+		for (size_t i = 0; i < items.size(); ++i)
+			object_indices[i] = items[i].index;
+	}
+
+	// Same result as testing every object in order, including which object wins ties.
+	// Children are visited front to back, and nodes starting beyond the nearest hit so far are skipped.
+	std::pair<SceneObject *, real> nearestIntersection(const std::vector<SceneObject *> & objects, const Ray & r) const noexcept
+	{
+		SceneObject * nearest_obj = nullptr;
+		real nearest_t = real_inf;
+		int  nearest_index = INT_MAX;
+
+		const auto test = [&](const int i)
+		{
+			const real hit_t = objects[i]->intersect(r);
+			if (hit_t > ray_epsilon && (hit_t < nearest_t || (hit_t == nearest_t && i < nearest_index)))
+			{
+				nearest_obj = objects[i];
+				nearest_t = hit_t;
+				nearest_index = i;
+			}
+		};
+
+		for (const int i : unbounded)
+			test(i);
+
+		if (nodes.empty())
+			return { nearest_obj, nearest_t };
+
+		const vec3r inv_d = { 1 / r.d.x(), 1 / r.d.y(), 1 / r.d.z() };
+		if (entryDistance(nodes[0], r.o, inv_d, nearest_t) == real_inf)
+			return { nearest_obj, nearest_t };
+
+		std::pair<int, real> stack[max_depth * 2];
+		int stack_size = 0;
+		int node = 0;
+		while (true)
+		{
+			const Node & n = nodes[node];
+			if (n.count > 0)
+			{
+				for (int j = n.offset; j < n.offset + n.count; ++j)
+					test(object_indices[j]);
+			}
+			else
+			{
+				const int  near_node = node + 1, far_node = n.offset;
+				const real near_t = entryDistance(nodes[near_node], r.o, inv_d, nearest_t);
+				const real  far_t = entryDistance(nodes[ far_node], r.o, inv_d, nearest_t);
+				if (near_t != real_inf || far_t != real_inf)
+				{
+					// Descend into the closer child and come back for the other one if it's still in front of the nearest hit
+					if (near_t <= far_t)
+					{
+						if (far_t != real_inf) stack[stack_size++] = { far_node, far_t };
+						node = near_node;
+					}
+					else
+					{
+						if (near_t != real_inf) stack[stack_size++] = { near_node, near_t };
+						node = far_node;
+					}
+					continue;
+				}
+			}
+
+			// Pop the next node which the ray enters before the nearest hit
+			while (stack_size > 0 && stack[stack_size - 1].second > nearest_t)
+				--stack_size;
+			if (stack_size == 0)
+				break;
+			node = stack[--stack_size].first;
+		}
+
+		return { nearest_obj, nearest_t };
+	}
+
+private:
+	struct Item
+	{
+		vec3r lo, hi, centroid;
+		int index;
+	};
+
+	static constexpr int max_leaf_size = 4;
+	static constexpr int max_depth = 32; // Deeper nodes are split at the median, which bounds the depth by 32 + log2(count)
+
+	// Distance along the ray to where it enters the box, infinite if it misses or enters beyond t_max.
+	// A zero direction component with the origin on the slab gives NaNs, which min and max ignore here.
+	static real entryDistance(const Node & n, const vec3r & o, const vec3r & inv_d, const real t_max) noexcept
+	{
+		real t0 = 0, t1 = t_max;
+		for (int k = 0; k < 3; ++k)
+		{
+			const real a = (n.lo.e[k] - o.e[k]) * inv_d.e[k];
+			const real b = (n.hi.e[k] - o.e[k]) * inv_d.e[k];
+			t0 = std::max(t0, std::min(a, b));
+			t1 = std::min(t1, std::max(a, b));
+		}
+		return (t0 <= t1) ? t0 : real_inf;
+	}
+
+	static real halfArea(const vec3r & lo, const vec3r & hi) noexcept
+	{
+		const vec3r e = hi - lo;
+		return e.x() * e.y() + e.y() * e.z() + e.z() * e.x();
+	}
+
+	int buildNode(std::vector<Item> & items, const int begin, const int end, const int depth)
+	{
+		vec3r lo = items[begin].lo, hi = items[begin].hi;
+		for (int i = begin + 1; i < end; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			lo.e[k] = std::min(lo.e[k], items[i].lo.e[k]);
+			hi.e[k] = std::max(hi.e[k], items[i].hi.e[k]);
+		}
+
+		const int node = (int)nodes.size();
+		nodes.push_back({ lo, hi, 0, 0 });
+
+		const int count = end - begin;
+		const auto make_leaf = [&]() { nodes[node].offset = begin; nodes[node].count = count; return node; };
+		if (count == 1)
+			return make_leaf();
+
+		// Sweep the objects sorted by centroid along each axis, with the costs of traversing a node and testing an
+		//  object taken as equal. Right side areas are accumulated first, then the left side on the way back.
+		const auto sort_axis = [&](const int axis)
+		{
+			std::sort(items.begin() + begin, items.begin() + end, [axis](const Item & a, const Item & b)
+				{ return (a.centroid.e[axis] != b.centroid.e[axis]) ? a.centroid.e[axis] < b.centroid.e[axis] : a.index < b.index; });
+		};
+
+		const real parent_area = halfArea(lo, hi);
+		real best_cost = (real)count;
+		int  best_axis = -1, best_split = 0;
+		if (depth < max_depth && parent_area > 0)
+		{
+			std::vector<real> right_area(count);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				sort_axis(axis);
+
+				vec3r box_lo = items[end - 1].lo, box_hi = items[end - 1].hi;
+				for (int i = count - 1; i > 0; --i)
+				{
+					for (int k = 0; k < 3; ++k)
+					{
+						box_lo.e[k] = std::min(box_lo.e[k], items[begin + i].lo.e[k]);
+						box_hi.e[k] = std::max(box_hi.e[k], items[begin + i].hi.e[k]);
+					}
+					right_area[i] = halfArea(box_lo, box_hi);
+				}
+
+				box_lo = items[begin].lo; box_hi = items[begin].hi;
+				for (int i = 1; i < count; ++i)
+				{
+					for (int k = 0; k < 3; ++k)
+					{
+						box_lo.e[k] = std::min(box_lo.e[k], items[begin + i - 1].lo.e[k]);
+						box_hi.e[k] = std::max(box_hi.e[k], items[begin + i - 1].hi.e[k]);
+					}
+					const real cost = 1 + (halfArea(box_lo, box_hi) * i + right_area[i] * (count - i)) / parent_area;
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_split = i;
+					}
+				}
+			}
+		}
+
+		if (best_axis < 0)
+		{
+			if (count <= max_leaf_size)
+				return make_leaf();
+
+			// Splitting doesn't pay off by the heuristic but the leaf would be too big, or the tree is already deep
+			const vec3r extent = hi - lo;
+			best_axis = (extent.x() > extent.y() && extent.x() > extent.z()) ? 0 : (extent.y() > extent.z()) ? 1 : 2;
+			best_split = count / 2;
+		}
+
+		sort_axis(best_axis);
+		buildNode(items, begin, begin + best_split, depth + 1);
+		const int second = buildNode(items, begin + best_split, end, depth + 1);
+		nodes[node].offset = second;
+		nodes[node].count = 0;
+		return node;
+	}
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+#include "../maths/real.h"
+#include "../maths/vec.h"
+#include "Ray.h"
+
+
+
+inline real signum(real v) { return (v >= 0) ? (real)1 : (v == 0 ? 0 : -1); }
+
+// Convert uniform distribution into triangle-shaped distribution
+// From https://www.shadertoy.com/view/4t2SDh
+inline real triDist(real v)
+{
+	const real orig = v * 2 - 1;
+	v = orig / std::sqrt(std::fabs(orig));
+	v = std::max((real)-1, v); // Nerf the NaN generated by 0*rsqrt(0). Thanks @FioraAeterna!
+	v = v - signum(orig);
+
+	return v;
+}
+
+// From Alex Evans
+inline vec2r CauchyDist(const vec2r & u)
+{
+	const vec2r h = u * vec2r(pi * 2, pi * 0.5f);
+	return vec2r(cos(h.x()), sin(h.x())) * tan(h.y());
+}
+
+
+// Pinhole or thin lens camera looking from position at lookat. In animations it orbits once around the up axis through
+//  the lookat, with motion blur over the fraction of each frame that the shutter is open.
+// setFrame() precomputes the camera basis for the frame, and for a set of times across the shutter interval, so that
+//  generating a ray only costs a few multiply-adds and a normalise.
+struct Camera
+{
+	vec3r position = { 1, 1.25f, -2.5f };
+	vec3r lookat   = { 0, -0.125f, 0 };
+	vec3r world_up = { 0, 1, 0 };
+	real fov_deg     = 80;
+	real lens_radius = 0.0005f; // Zero for a pinhole camera
+	real focal_dist  = 0;       // Distance to the plane in focus along the view direction, zero for 0.65 of the distance to the lookat
+	real shutter     = 0.1f;    // Fraction of a frame the shutter is open for in animations, zero to disable motion blur
+
+	static constexpr int num_shutter_times = 64; // Motion blur samples this many evenly weighted times in the shutter interval
+
+	bool depthOfField() const noexcept { return lens_radius > 0; }
+	bool motionBlur()   const noexcept { return motion_blur; }
+
+	// For an xres * yres image, with pixel coordinates relative to (x0, y0) when rendering a tile of it.
+	// With scale > 1 the pixels are scale x scale blocks of the image's pixels, for coarse previews of the same view.
+	void setFrame(const int frame, const int frames, const int xres, const int yres, const int x0 = 0, const int y0 = 0, const int scale = 1) noexcept
+	{
+		motion_blur = frames > 0 && shutter > 0;
+		tile_x0 = x0;
+		tile_y0 = y0;
+
+		still_view = makeView((frames > 0) ? two_pi * frame / frames : 0, xres, yres, scale);
+
+		// The times are quantiles of the tent filter over the shutter interval, which are then sampled uniformly
+		if (motion_blur)
+			for (int i = 0; i < num_shutter_times; ++i)
+				shutter_views[i] = makeView(two_pi * (frame + shutter * triDist((i + (real)0.5) / num_shutter_times)) / frames, xres, yres, scale);
+	}
+
+	// Generate a camera ray through a jittered position in pixel (x, y)
+	template <typename Features, typename Sampler>
+	Ray generateRay(const int x, const int y, Sampler & sampler) const noexcept
+	{
+		const vec2r pixel_u = sampler.next2();
+#if 1
+		const vec2r pixel_offset(
+			triDist(pixel_u.x()),
+			triDist(pixel_u.y()));
+#else
+		const vec2r pixel_offset = CauchyDist(pixel_u);
+#endif
+
+		const View * view = &still_view;
+		if constexpr (Features::motion_blur)
+			view = &shutter_views[std::min((int)(sampler.next() * num_shutter_times), num_shutter_times - 1)];
+
+		vec3r ray_p = view->position;
+		// Offset to image coordinates first, so that tiles render exactly the same rays as the whole image
+		const int image_x = tile_x0 + x;
+		const int image_y = tile_y0 + y;
+		vec3r ray_d = normalise(view->pixel_00 + view->pixel_x * (image_x + pixel_offset.x()) + view->pixel_y * (image_y + pixel_offset.y()));
+		if constexpr (Features::depth_of_field)
+		{
+			// Random point on disc
+			const vec2r lens_u = sampler.next2();
+			const real lens_r = std::sqrt(lens_u.x()) * lens_radius;
+			const real lens_a = two_pi *  lens_u.y();
+			const vec3r focal_point = ray_p + ray_d * (view->focal_dist / dot(ray_d, view->forward));
+
+			ray_p += view->right * (std::cos(lens_a) * lens_r) + view->up * (std::sin(lens_a) * lens_r);
+			ray_d = normalise(focal_point - ray_p);
+		}
+
+		return { ray_p, ray_d };
+	}
+
+	// Cone containing every camera ray of the still view through the image rectangle [x0, x1] x [y0, y1], in pixels including
+	//  the filter offsets. Returns the axis, with the cone's radius being base_radius + t * spread at distance t along it.
+	Ray pixelCone(const real x0, const real x1, const real y0, const real y1, real & base_radius, real & spread) const noexcept
+	{
+		const View & v = still_view;
+		const auto direction = [&](const real x, const real y) { return normalise(v.pixel_00 + v.pixel_x * (x + tile_x0) + v.pixel_y * (y + tile_y0)); };
+		const vec3r axis = direction((x0 + x1) * 0.5f, (y0 + y1) * 0.5f);
+
+		// The angle to the axis over a rectangle on the image plane is largest at a corner, and rays at distance t are then
+		//  at most t times the chord between the directions from the axis
+		spread = 0;
+		for (const real y : { y0, y1 })
+		for (const real x : { x0, x1 })
+			spread = std::max(spread, length(direction(x, y) - axis));
+
+		// Lens rays start up to the lens radius away, and converge on the pinhole rays at the focal plane
+		base_radius = lens_radius;
+		spread += 4 * lens_radius / v.focal_dist;
+
+		return { v.position, axis };
+	}
+
+private:
+	// Camera basis at one point in time
+	struct View
+	{
+		vec3r position, forward, right, up;
+		vec3r pixel_00, pixel_x, pixel_y; // Direction through the centre of pixel (0, 0) and the steps to the next pixel
+		real focal_dist;
+	};
+
+	bool motion_blur = false;
+	int tile_x0 = 0, tile_y0 = 0;
+	View still_view;
+	View shutter_views[num_shutter_times];
+
+	View makeView(const real time, const int xres, const int yres, const int scale) const noexcept
+	{
+		const real aspect_ratio = xres / (real)yres;
+		const real fov_rad = fov_deg * two_pi / 360; // Convert from degrees to radians
+		const real sensor_width  = 2 * std::tan(fov_rad / 2);
+		const real sensor_height = sensor_width / aspect_ratio;
+
+		// Rotate the position around the up axis through the lookat
+		const real cos_t = std::cos(time);
+		const real sin_t = std::sin(time);
+		const vec3r axis = normalise(world_up);
+		const vec3r offset = position - lookat;
+		const vec3r cam_pos = lookat + offset * cos_t - cross(axis, offset) * sin_t + axis * (dot(axis, offset) * (1 - cos_t));
+
+		View v;
+		v.position = cam_pos;
+		v.forward = normalise(lookat - cam_pos);
+		v.right = normalise(cross(world_up, v.forward));
+		v.up = normalise(cross(v.forward, v.right));
+
+		v.pixel_x = v.right * (sensor_width  / xres);
+		v.pixel_y = v.up   * -(sensor_height / yres);
+		v.pixel_00 = v.forward + v.pixel_x * (xres * -0.5f + 0.5f) + v.pixel_y * (yres * -0.5f + 0.5f);
+
+		// Coarse pixels are centred on their blocks of image pixels
+		v.pixel_00 += (v.pixel_x + v.pixel_y) * ((scale - 1) * (real)0.5);
+		v.pixel_x *= (real)scale;
+		v.pixel_y *= (real)scale;
+
+		v.focal_dist = (focal_dist > 0) ? focal_dist : length(cam_pos - lookat) * 0.65f;
+		return v;
+	}
+};
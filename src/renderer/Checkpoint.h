@@ -0,0 +1,172 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <array>
+
+#include "Renderer.h"
+#include "util/AtomicFile.h"
+
+
+// Copy of the state of a progressive render, which can be written to disk while rendering carries on and read back to resume.
+// The samplers are a pure function of the pixel and pass index, so the pass count is all the sampler state there is.
+// Path guiding and the radiance cache aren't saved, so renders using them can't be resumed.
+struct RenderCheckpoint
+{
+	int xres = 0, yres = 0;
+	int pass = 0;               // Number of passes started so far
+	int target_passes = 0;      // End of the current round of passes
+	uint64_t settings_hash = 0; // Identifies the options the render was started with, only matching checkpoints are resumed
+
+	// Copies of the output buffers, the optional ones are empty if the render doesn't have them
+	std::vector<vec3f> beauty, normal, albedo;
+	std::vector<float> depth, beauty_lum2;
+	std::vector<int>   samples;
+	std::vector<std::array<uint16_t, 3>> normal_half, albedo_half;
+	std::vector<uint16_t> depth_half;
+	std::vector<uint8_t> converged; // Adaptive sampling state, empty if not used
+	std::vector<int> active_buckets;
+
+
+	// Copy the render state between passes, the buffers are reused from the previous checkpoint
+	void capture(const RenderOutput & output, const AdaptiveSampling * const adaptive, const int pass_, const int target_passes_)
+	{
+		xres = output.xres;
+		yres = output.yres;
+		pass = pass_;
+		target_passes = target_passes_;
+
+		beauty = output.beauty;
+		normal = output.normal;
+		albedo = output.albedo;
+		depth  = output.depth;
+		beauty_lum2 = output.beauty_lum2;
+		samples = output.samples;
+		normal_half = output.normal_half;
+		albedo_half = output.albedo_half;
+		depth_half  = output.depth_half;
+
+		converged.clear();
+		active_buckets.clear();
+		if (adaptive)
+		{
+			converged = adaptive->converged;
+			active_buckets = adaptive->active_buckets;
+		}
+	}
+
+	// Put the state back into a render with the same resolution and AOVs
+	void restore(RenderOutput & output, AdaptiveSampling * const adaptive) const
+	{
+		output.beauty = beauty;
+		output.normal = normal;
+		output.albedo = albedo;
+		output.depth  = depth;
+		output.beauty_lum2 = beauty_lum2;
+		output.samples = samples;
+		output.normal_half = normal_half;
+		output.albedo_half = albedo_half;
+		output.depth_half  = depth_half;
+
+		if (adaptive && !converged.empty())
+		{
+			adaptive->converged = converged;
+			adaptive->active_buckets = active_buckets;
+		}
+	}
+
+	bool write(const std::string & path) const
+	{
+		const std::vector<std::pair<const void *, size_t>> sections =
+		{
+			{ beauty.data(), beauty.size() * sizeof(vec3f) },
+			{ normal.data(), normal.size() * sizeof(vec3f) },
+			{ albedo.data(), albedo.size() * sizeof(vec3f) },
+			{ depth.data(),  depth.size()  * sizeof(float) },
+			{ beauty_lum2.data(), beauty_lum2.size() * sizeof(float) },
+			{ samples.data(), samples.size() * sizeof(int) },
+			{ normal_half.data(), normal_half.size() * sizeof(normal_half[0]) },
+			{ albedo_half.data(), albedo_half.size() * sizeof(albedo_half[0]) },
+			{ depth_half.data(),  depth_half.size()  * sizeof(uint16_t) },
+			{ converged.data(), converged.size() },
+			{ active_buckets.data(), active_buckets.size() * sizeof(int) }
+		};
+
+		// Write to a temporary file and rename it into place, so that dying while writing leaves the previous checkpoint intact
+		const std::string temp_path = atomicTempPath(path);
+		FILE * const f = fopen(temp_path.c_str(), "wb");
+		if (f == nullptr)
+			return false;
+
+		const Header header = { { 'F', 'T', 'C', 'K', 'P', 'T', '0', '2' }, settings_hash,
+			xres, yres, pass, target_passes, (int32_t)converged.size(), (int32_t)active_buckets.size() };
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+		for (const auto & [ptr, bytes] : sections)
+			ok = ok && fwrite(ptr, 1, bytes, f) == bytes;
+		ok = (fclose(f) == 0) && ok;
+
+		if (!ok)
+		{
+			std::remove(temp_path.c_str());
+			return false;
+		}
+		return atomicReplace(temp_path, path);
+	}
+
+	// Returns false if the file is missing, truncated or was written by a render with different settings.
+	// The output gives the expected resolution and which AOVs there are.
+	bool read(const std::string & path, const uint64_t expected_settings_hash, const RenderOutput & output)
+	{
+		const int expected_xres = output.xres, expected_yres = output.yres;
+		FILE * const f = fopen(path.c_str(), "rb");
+		if (f == nullptr)
+			return false;
+
+		Header header;
+		bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+			std::memcmp(header.magic, "FTCKPT02", 8) == 0 && header.settings_hash == expected_settings_hash &&
+			header.xres == expected_xres && header.yres == expected_yres &&
+			(header.num_converged == 0 || header.num_converged == expected_xres * expected_yres) &&
+			header.num_active_buckets >= 0 && header.num_active_buckets <= numBuckets(expected_xres) * numBuckets(expected_yres);
+
+		if (ok)
+		{
+			settings_hash = header.settings_hash;
+			xres = header.xres;
+			yres = header.yres;
+			pass = header.pass;
+			target_passes = header.target_passes;
+
+			const auto read_section = [&](auto & array, const size_t count)
+			{
+				array.resize(count);
+				ok = ok && fread(array.data(), sizeof(array[0]), count, f) == count;
+			};
+			read_section(beauty, output.beauty.size());
+			read_section(normal, output.normal.size());
+			read_section(albedo, output.albedo.size());
+			read_section(depth,  output.depth.size());
+			read_section(beauty_lum2, output.beauty_lum2.size());
+			read_section(samples, output.samples.size());
+			read_section(normal_half, output.normal_half.size());
+			read_section(albedo_half, output.albedo_half.size());
+			read_section(depth_half,  output.depth_half.size());
+			read_section(converged, header.num_converged);
+			read_section(active_buckets, header.num_active_buckets);
+		}
+
+		fclose(f);
+		return ok;
+	}
+
+private:
+	struct Header
+	{
+		char magic[8];
+		uint64_t settings_hash;
+		int32_t xres, yres, pass, target_passes, num_converged, num_active_buckets;
+	};
+};
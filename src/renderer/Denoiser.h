@@ -0,0 +1,329 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "maths/vec.h"
+#include "Renderer.h"
+
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010) guided by the normal, albedo and depth AOVs.
+// The luminance edge stopping function is scaled by the estimated per-pixel standard deviation as in SVGF (Schied et al. 2017),
+//  so noisy pixels are blurred more and converged ones are left alone.
+struct Denoiser
+{
+	int   num_iterations = 5;    // Filter footprint doubles each iteration, 5 iterations span 61 x 61 pixels
+	float sigma_luminance = 4;   // Luminance tolerance in standard deviations
+	int   normal_power_log2 = 7; // Normal weight is max(0, dot(n_p, n_q))^(2^normal_power_log2)
+	float sigma_depth = 0.05f;   // Relative depth tolerance per pixel of filter step
+
+	// Denoise the accumulated beauty buffer, the result is normalised (not a sum of samples) and in the output's pixel order.
+	// Needs the normal, albedo, depth and variance AOVs.
+	void denoise(const RenderOutput & output, std::vector<vec3f> & result)
+	{
+		const int xres = output.xres;
+		const int yres = output.yres;
+		const int num_pixels = xres * yres;
+
+		for (int i = 0; i < 2; ++i)
+		{
+			for (int c = 0; c < 3; ++c)
+				colour[i][c].resize(num_pixels);
+			variance[i].resize(num_pixels);
+		}
+		for (int c = 0; c < 3; ++c)
+			normal[c].resize(num_pixels);
+		modulation.resize(num_pixels);
+		depth.resize(num_pixels);
+		filtered_variance.resize(num_pixels);
+		result.resize(num_pixels);
+
+		// Average the sums and demodulate the albedo, so that surface texture isn't blurred and doesn't stop the filter.
+		// The filter works on rows of pixels, so this also converts from the output's bucket order.
+		#pragma omp parallel for
+		for (int y = 0; y < yres; ++y)
+		for (int x = 0; x < xres; ++x)
+		{
+			const int i = y * xres + x;
+			const int p = output.pixelIndex(x, y);
+			const int n = output.samples[p];
+			if (n == 0)
+			{
+				for (int c = 0; c < 3; ++c) { colour[0][c][i] = 0; normal[c][i] = 0; }
+				variance[0][i] = 0; modulation[i] = 1; depth[i] = 0;
+				continue;
+			}
+
+			const float inv_n = 1.0f / n;
+			const vec3f a = output.albedoMean(p);
+			const vec3f m = { a.x() > 1e-3f ? a.x() : 1, a.y() > 1e-3f ? a.y() : 1, a.z() > 1e-3f ? a.z() : 1 };
+			const float lum_m = luminance(m);
+
+			const vec3f mean = output.beauty[p] * inv_n;
+			const float mean_lum = luminance(mean);
+
+			// Variance of the pixel mean, with a single sample just assume 100% relative error
+			const float var = (n > 1) ?
+				std::max(0.0f, output.beauty_lum2[p] * inv_n - mean_lum * mean_lum) / (n - 1) :
+				mean_lum * mean_lum;
+
+			const vec3f demodulated = mean / m;
+			variance[0][i] = var / (lum_m * lum_m);
+			modulation[i]  = m;
+			depth[i]       = output.depthMean(p);
+
+			// Decode from [0, 1], misses have no normal (and add a bias towards -1 to partially covered pixels)
+			const vec3f nrm = output.normalMean(p) * 2 - 1;
+			const float nrm_len = length(nrm);
+			const vec3f unit_nrm = (depth[i] > 0 && nrm_len > 1e-3f) ? nrm / nrm_len : vec3f(0);
+			for (int c = 0; c < 3; ++c)
+			{
+				colour[0][c][i] = demodulated.e[c];
+				normal[c][i] = unit_nrm.e[c];
+			}
+		}
+
+		int src = 0;
+		for (int iteration = 0; iteration < num_iterations; ++iteration)
+		{
+			filterVariance(variance[src], xres, yres);
+			filterStep(src, xres, yres, 1 << iteration);
+			src = 1 - src;
+		}
+
+		#pragma omp parallel for
+		for (int y = 0; y < yres; ++y)
+		for (int x = 0; x < xres; ++x)
+		{
+			const int i = y * xres + x;
+			result[output.pixelIndex(x, y)] = vec3f(colour[src][0][i], colour[src][1][i], colour[src][2][i]) * modulation[i];
+		}
+	}
+
+private:
+	// Images are stored as separate planes per channel, so that the filter can work on 8 neighbouring pixels at once
+	std::vector<float> colour[2][3]; // Demodulated colour, ping-ponged between iterations
+	std::vector<float> variance[2];  // Luminance variance of the demodulated colour
+	std::vector<vec3f> modulation;   // Albedo divided out of the colour
+	std::vector<float> normal[3];
+	std::vector<float> depth;
+	std::vector<float> filtered_variance;
+
+	static constexpr float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 }; // B3 spline
+
+	// Edge stopping factors below this are taken as zero. Otherwise the normal power and exp underflow to denormals, which
+	//  are very slow to compute with, and the squared weights for the variance do too.
+	static constexpr float min_edge_weight = 1e-8f;
+
+	// 3x3 Gaussian blur of the variance for the edge stopping function, which is otherwise too noisy at low sample counts
+	void filterVariance(const std::vector<float> & var, const int xres, const int yres) noexcept
+	{
+		#pragma omp parallel for
+		for (int y = 0; y < yres; ++y)
+		for (int x = 0; x < xres; ++x)
+		{
+			float sum = 0, weight_sum = 0;
+			for (int dy = -1; dy <= 1; ++dy)
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				const int qx = x + dx, qy = y + dy;
+				if (qx < 0 || qx >= xres || qy < 0 || qy >= yres)
+					continue;
+
+				const float w = ((dx == 0) ? 2.0f : 1.0f) * ((dy == 0) ? 2.0f : 1.0f);
+				sum += var[qy * xres + qx] * w;
+				weight_sum += w;
+			}
+			filtered_variance[y * xres + x] = sum / weight_sum;
+		}
+	}
+
+	// One a-trous iteration with the 5x5 B3 spline kernel dilated by step, from buffers src to 1 - src, also propagating the variance.
+	// With AVX2 runs of 8 pixels whose taps are all inside the row are filtered together, the rest one at a time.
+	void filterStep(const int src, const int xres, const int yres, const int step) noexcept
+	{
+		const EdgeParams params = { std::pow(min_edge_weight, 1.0f / (1 << normal_power_log2)), std::log(min_edge_weight), 1 / (sigma_depth * step) };
+
+		#pragma omp parallel for schedule(dynamic, 4)
+		for (int y = 0; y < yres; ++y)
+		{
+			int x = 0;
+#if defined(__AVX2__)
+			for (; x < 2 * step && x < xres; ++x)
+				filterPixel(src, x, y, xres, yres, step, params);
+			for (; x + 8 + 2 * step <= xres; x += 8)
+				filterPixels8(src, x, y, xres, yres, step, params);
+#endif
+			for (; x < xres; ++x)
+				filterPixel(src, x, y, xres, yres, step, params);
+		}
+	}
+
+	struct EdgeParams
+	{
+		float min_normal_dot; // Smallest normal similarity that doesn't raise to below min_edge_weight
+		float min_exponent;   // Log of min_edge_weight
+		float inv_sigma_z;
+	};
+
+	void filterPixel(const int src, const int x, const int y, const int xres, const int yres, const int step, const EdgeParams & params) noexcept
+	{
+		const std::vector<float> * const c = colour[src];
+		const int p = y * xres + x;
+		const float n_p[3] = { normal[0][p], normal[1][p], normal[2][p] };
+		const float z_p = depth[p];
+		const float l_p = luminance({ c[0][p], c[1][p], c[2][p] });
+		const float inv_sigma_l = 1 / (sigma_luminance * std::sqrt(filtered_variance[p]) + 1e-6f);
+
+		float colour_sum[3] = { 0, 0, 0 };
+		float var_sum = 0, weight_sum = 0;
+		for (int ky = 0; ky < 5; ++ky)
+		{
+			const int qy = y + (ky - 2) * step;
+			if (qy < 0 || qy >= yres)
+				continue;
+
+			for (int kx = 0; kx < 5; ++kx)
+			{
+				const int qx = x + (kx - 2) * step;
+				if (qx < 0 || qx >= xres)
+					continue;
+
+				const int q = qy * xres + qx;
+				float w = kernel[2] * kernel[2];
+				if (q != p)
+				{
+					// Raise the normal similarity to a high power by repeated squaring
+					float w_n = std::min(1.0f, n_p[0] * normal[0][q] + n_p[1] * normal[1][q] + n_p[2] * normal[2][q]);
+					w_n = (w_n >= params.min_normal_dot) ? w_n : 0;
+					for (int i = 0; i < normal_power_log2; ++i)
+						w_n *= w_n;
+
+					// Relative depth difference, which also separates hits from misses (zero depth)
+					const float z_q = depth[q];
+					const float z_rel = std::fabs(z_p - z_q) / (std::max(z_p, z_q) + 1e-6f);
+
+					const float l_diff = std::fabs(l_p - luminance({ c[0][q], c[1][q], c[2][q] }));
+
+					const float exponent = -(z_rel * params.inv_sigma_z) - l_diff * inv_sigma_l;
+					w = kernel[kx] * kernel[ky] * w_n * ((exponent >= params.min_exponent) ? fastExp(exponent) : 0);
+				}
+
+				for (int k = 0; k < 3; ++k)
+					colour_sum[k] += c[k][q] * w;
+				var_sum    += variance[src][q] * (w * w);
+				weight_sum += w;
+			}
+		}
+
+		// The centre pixel always has nonzero weight
+		for (int k = 0; k < 3; ++k)
+			colour[1 - src][k][p] = colour_sum[k] / weight_sum;
+		variance[1 - src][p] = var_sum / (weight_sum * weight_sum);
+	}
+
+	// exp(x) for x <= 0, to about 1e-7 relative error or flushed to a tiny value below -87.
+	// 2^round(t) goes straight into the exponent bits, and a Taylor series does e^(f ln 2) for |f| <= 0.5.
+	static float fastExp(const float x) noexcept
+	{
+		const float t = std::max(x, -87.0f) * 1.44269504f;
+		const float i = std::floor(t + 0.5f);
+		const float g = (t - i) * 0.693147181f;
+		const float e = 1 + g * (1 + g * (1.0f / 2 + g * (1.0f / 6 + g * (1.0f / 24 + g * (1.0f / 120 + g * (1.0f / 720))))));
+		const int32_t scale_bits = ((int32_t)i + 127) << 23;
+		float scale; std::memcpy(&scale, &scale_bits, sizeof(float));
+		return e * scale;
+	}
+
+#if defined(__AVX2__)
+	static __m256 fastExp8(const __m256 x) noexcept
+	{
+		const __m256 t = _mm256_mul_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(1.44269504f));
+		const __m256 i = _mm256_floor_ps(_mm256_add_ps(t, _mm256_set1_ps(0.5f)));
+		const __m256 g = _mm256_mul_ps(_mm256_sub_ps(t, i), _mm256_set1_ps(0.693147181f));
+		__m256 e = _mm256_set1_ps(1.0f / 720);
+		for (const float k : { 1.0f / 120, 1.0f / 24, 1.0f / 6, 1.0f / 2, 1.0f, 1.0f })
+			e = _mm256_add_ps(_mm256_mul_ps(e, g), _mm256_set1_ps(k));
+		const __m256i scale_bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(e, _mm256_castsi256_ps(scale_bits));
+	}
+
+	static __m256 luminance8(const __m256 r, const __m256 g, const __m256 b) noexcept
+	{
+		return _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(r, _mm256_set1_ps(0.2126f)),
+			_mm256_mul_ps(g, _mm256_set1_ps(0.7152f))),
+			_mm256_mul_ps(b, _mm256_set1_ps(0.0722f)));
+	}
+
+	// Same as filterPixel for pixels x to x + 7, with all the taps inside the row
+	void filterPixels8(const int src, const int x, const int y, const int xres, const int yres, const int step, const EdgeParams & params) noexcept
+	{
+		const std::vector<float> * const c = colour[src];
+		const int p = y * xres + x;
+		const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+		const __m256 n_p[3] = { _mm256_loadu_ps(&normal[0][p]), _mm256_loadu_ps(&normal[1][p]), _mm256_loadu_ps(&normal[2][p]) };
+		const __m256 z_p = _mm256_loadu_ps(&depth[p]);
+		const __m256 l_p = luminance8(_mm256_loadu_ps(&c[0][p]), _mm256_loadu_ps(&c[1][p]), _mm256_loadu_ps(&c[2][p]));
+		const __m256 inv_sigma_l = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(sigma_luminance), _mm256_sqrt_ps(_mm256_loadu_ps(&filtered_variance[p]))), _mm256_set1_ps(1e-6f)));
+		const __m256 inv_sigma_z = _mm256_set1_ps(params.inv_sigma_z);
+		const __m256 min_normal_dot = _mm256_set1_ps(params.min_normal_dot);
+		const __m256 min_exponent = _mm256_set1_ps(params.min_exponent);
+
+		__m256 colour_sum[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+		__m256 var_sum = _mm256_setzero_ps(), weight_sum = _mm256_setzero_ps();
+		for (int ky = 0; ky < 5; ++ky)
+		{
+			const int qy = y + (ky - 2) * step;
+			if (qy < 0 || qy >= yres)
+				continue;
+
+			for (int kx = 0; kx < 5; ++kx)
+			{
+				const int q = qy * xres + x + (kx - 2) * step;
+				const __m256 c_q[3] = { _mm256_loadu_ps(&c[0][q]), _mm256_loadu_ps(&c[1][q]), _mm256_loadu_ps(&c[2][q]) };
+
+				__m256 w = _mm256_set1_ps(kernel[2] * kernel[2]);
+				if (q != p)
+				{
+					const __m256 dot_n = _mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(n_p[0], _mm256_loadu_ps(&normal[0][q])),
+						_mm256_mul_ps(n_p[1], _mm256_loadu_ps(&normal[1][q]))),
+						_mm256_mul_ps(n_p[2], _mm256_loadu_ps(&normal[2][q])));
+					__m256 w_n = _mm256_min_ps(_mm256_set1_ps(1.0f), dot_n);
+					w_n = _mm256_and_ps(w_n, _mm256_cmp_ps(w_n, min_normal_dot, _CMP_GE_OQ));
+					for (int i = 0; i < normal_power_log2; ++i)
+						w_n = _mm256_mul_ps(w_n, w_n);
+
+					const __m256 z_q = _mm256_loadu_ps(&depth[q]);
+					const __m256 z_rel = _mm256_div_ps(_mm256_andnot_ps(sign_mask, _mm256_sub_ps(z_p, z_q)),
+						_mm256_add_ps(_mm256_max_ps(z_p, z_q), _mm256_set1_ps(1e-6f)));
+
+					const __m256 l_diff = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(l_p, luminance8(c_q[0], c_q[1], c_q[2])));
+
+					const __m256 exponent = _mm256_sub_ps(_mm256_xor_ps(_mm256_mul_ps(z_rel, inv_sigma_z), sign_mask), _mm256_mul_ps(l_diff, inv_sigma_l));
+					const __m256 w_e = _mm256_and_ps(fastExp8(exponent), _mm256_cmp_ps(exponent, min_exponent, _CMP_GE_OQ));
+					w = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(kernel[kx] * kernel[ky]), w_n), w_e);
+				}
+
+				for (int k = 0; k < 3; ++k)
+					colour_sum[k] = _mm256_add_ps(colour_sum[k], _mm256_mul_ps(c_q[k], w));
+				var_sum    = _mm256_add_ps(var_sum, _mm256_mul_ps(_mm256_loadu_ps(&variance[src][q]), _mm256_mul_ps(w, w)));
+				weight_sum = _mm256_add_ps(weight_sum, w);
+			}
+		}
+
+		for (int k = 0; k < 3; ++k)
+			_mm256_storeu_ps(&colour[1 - src][k][p], _mm256_div_ps(colour_sum[k], weight_sum));
+		_mm256_storeu_ps(&variance[1 - src][p], _mm256_div_ps(var_sum, _mm256_mul_ps(weight_sum, weight_sum)));
+	}
+#endif
+};
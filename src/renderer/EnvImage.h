@@ -0,0 +1,196 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "maths/vec.h"
+#include "util/MappedFile.h"
+
+
+// Shared exponent RGB9E5 encoding (EXT_texture_shared_exponent): 9 bit mantissas and a 5 bit exponent in 32 bits.
+// Relative precision is about 1/512 of the largest component, which is plenty for environment lighting.
+inline uint32_t encodeRGB9E5(const vec3f & c) noexcept
+{
+	constexpr int mantissa_bits = 9, exp_bias = 15;
+	constexpr float max_value = (float)(511.0 / 512.0 * 65536.0); // Largest representable value
+
+	const float r = std::max(0.0f, std::min(max_value, c.x()));
+	const float g = std::max(0.0f, std::min(max_value, c.y()));
+	const float b = std::max(0.0f, std::min(max_value, c.z()));
+	const float max_c = std::max(r, std::max(g, b));
+	if (!(max_c > 0)) return 0; // Also catches NaNs
+
+	int exp; std::frexp(max_c, &exp); // max_c = m * 2^exp with m in [0.5, 1), so floor(log2(max_c)) = exp - 1
+	int shared_exp = std::max(-exp_bias - 1, exp - 1) + 1 + exp_bias;
+
+	// Rounding the largest component up can overflow the mantissa, in which case go to the next exponent
+	float scale = std::ldexp(1.0f, mantissa_bits + exp_bias - shared_exp);
+	if ((int)std::floor(max_c * scale + 0.5f) == (1 << mantissa_bits))
+	{
+		shared_exp += 1;
+		scale *= 0.5f;
+	}
+
+	const uint32_t rm = (uint32_t)std::floor(r * scale + 0.5f);
+	const uint32_t gm = (uint32_t)std::floor(g * scale + 0.5f);
+	const uint32_t bm = (uint32_t)std::floor(b * scale + 0.5f);
+	return rm | (gm << 9) | (bm << 18) | ((uint32_t)shared_exp << 27);
+}
+
+inline vec3f decodeRGB9E5(const uint32_t v) noexcept
+{
+	// Build the scale 2^(e - 15 - 9) directly from the float exponent bits, e - 24 + 127 is always a normal exponent
+	const uint32_t scale_bits = ((v >> 27) + (127 - 24)) << 23;
+	float scale; std::memcpy(&scale, &scale_bits, sizeof(float));
+
+	return vec3f(
+		(float)((v      ) & 511),
+		(float)((v >>  9) & 511),
+		(float)((v >> 18) & 511)) * scale;
+}
+
+
+// 2D texel storage for environment maps, either plain float RGB or RGB9E5 in 8x8 tiles.
+// The packed layout is a third of the size, and a bilinear footprint usually falls within a single 256 byte tile.
+struct EnvImage
+{
+	static constexpr int tile_bits = 3;
+	static constexpr int tile_size = 1 << tile_bits;
+	static constexpr int tile_mask = tile_size - 1;
+
+	int width  = 0;
+	int height = 0;
+	int tiles_x = 0;
+	bool packed = false;
+
+	MappedArray<vec3f>    texels;        // Row major, if not packed
+	MappedArray<uint32_t> packed_texels; // Tile major RGB9E5, if packed
+
+	void resize(const int width_, const int height_, const bool packed_)
+	{
+		setSize(width_, height_, packed_);
+		texels.clear();
+		packed_texels.clear();
+		if (packed)
+			packed_texels.resize(numTexels(), 0);
+		else
+			texels.resize(numTexels());
+	}
+
+	// Use texels stored elsewhere (e.g. a mapped cache file) in the layout given by byteSize()
+	void map(const int width_, const int height_, const bool packed_, const void * const bytes) noexcept
+	{
+		setSize(width_, height_, packed_);
+		texels.clear();
+		packed_texels.clear();
+		if (packed)
+			packed_texels.map((const uint32_t *)bytes, numTexels());
+		else
+			texels.map((const vec3f *)bytes, numTexels());
+	}
+
+	bool empty() const noexcept { return width <= 0 || height <= 0; }
+
+	const void * bytes() const noexcept { return packed ? (const void *)packed_texels.data() : (const void *)texels.data(); }
+	size_t byteSize() const noexcept { return numTexels() * (packed ? sizeof(uint32_t) : sizeof(vec3f)); }
+
+	size_t memoryUsage() const noexcept { return texels.size() * sizeof(vec3f) + packed_texels.size() * sizeof(uint32_t); }
+
+	vec3f get(const int x, const int y) const noexcept
+	{
+		return packed ? decodeRGB9E5(packed_texels[packedIndex(x, y)]) : texels[(size_t)y * width + x];
+	}
+
+	// Blend of the 2x2 texels starting at (x, y) with bilinear weights for the fractional position (fx, fy), which must all be
+	//  inside the image. With SSE2 each texel is one register of r, g, b and a spare lane, giving the same sums as get().
+	vec3f bilinear(const int x, const int y, const float fx, const float fy) const noexcept
+	{
+#if defined(__SSE2__)
+		__m128 t00, t10, t01, t11;
+		texelPair(x, y,     t00, t10);
+		texelPair(x, y + 1, t01, t11);
+		const __m128 sum =
+			_mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(t00, _mm_set1_ps((1 - fx) * (1 - fy))),
+			_mm_mul_ps(t10, _mm_set1_ps((    fx) * (1 - fy)))),
+			_mm_mul_ps(t01, _mm_set1_ps((1 - fx) * (    fy)))),
+			_mm_mul_ps(t11, _mm_set1_ps((    fx) * (    fy))));
+
+		alignas(16) float c[4];
+		_mm_store_ps(c, sum);
+		return { c[0], c[1], c[2] };
+#else
+		return
+			get(x,     y    ) * ((1 - fx) * (1 - fy)) +
+			get(x + 1, y    ) * ((    fx) * (1 - fy)) +
+			get(x,     y + 1) * ((1 - fx) * (    fy)) +
+			get(x + 1, y + 1) * ((    fx) * (    fy));
+#endif
+	}
+
+	void set(const int x, const int y, const vec3f & c) noexcept
+	{
+		if (packed)
+			packed_texels[packedIndex(x, y)] = encodeRGB9E5(c);
+		else
+			texels[(size_t)y * width + x] = c;
+	}
+
+private:
+#if defined(__SSE2__)
+	// Texels (x, y) and (x + 1, y) as r, g, b and an unused lane
+	void texelPair(const int x, const int y, __m128 & left, __m128 & right) const noexcept
+	{
+		if (!packed)
+		{
+			// Both loads stay within the 6 floats of the two texels, the right one is rotated down by a lane
+			const float * const p = &texels[(size_t)y * width + x].e[0];
+			left = _mm_loadu_ps(p);
+			right = _mm_loadu_ps(p + 2);
+			right = _mm_shuffle_ps(right, right, _MM_SHUFFLE(0, 3, 2, 1));
+			return;
+		}
+
+		left  = decode4(packed_texels[packedIndex(x,     y)]);
+		right = decode4(packed_texels[packedIndex(x + 1, y)]);
+	}
+
+	// Mask the 3 mantissas into separate lanes, their scales by 1, 2^-9 and 2^-18 are exact so this matches decodeRGB9E5
+	static __m128 decode4(const uint32_t v) noexcept
+	{
+		const uint32_t scale_bits = ((v >> 27) + (127 - 24)) << 23;
+		const __m128i m = _mm_and_si128(_mm_set1_epi32((int)v), _mm_setr_epi32(511, 511 << 9, 511 << 18, 0));
+		const __m128  c = _mm_mul_ps(_mm_cvtepi32_ps(m), _mm_setr_ps(1.0f, 1.0f / (1 << 9), 1.0f / (1 << 18), 0.0f));
+		return _mm_mul_ps(c, _mm_castsi128_ps(_mm_set1_epi32((int)scale_bits)));
+	}
+#endif
+
+	void setSize(const int width_, const int height_, const bool packed_) noexcept
+	{
+		width  = width_;
+		height = height_;
+		packed = packed_;
+		tiles_x = (width + tile_mask) >> tile_bits;
+	}
+
+	// Number of stored texels, including the padding of partial tiles when packed
+	size_t numTexels() const noexcept
+	{
+		if (!packed) return (size_t)width * height;
+		const int tiles_y = (height + tile_mask) >> tile_bits;
+		return (size_t)tiles_x * tiles_y * tile_size * tile_size;
+	}
+
+	size_t packedIndex(const int x, const int y) const noexcept
+	{
+		const size_t tile = (size_t)(y >> tile_bits) * tiles_x + (x >> tile_bits);
+		return (tile << (2 * tile_bits)) + ((y & tile_mask) << tile_bits) + (x & tile_mask);
+	}
+};
@@ -1,21 +1,52 @@
 #pragma once
 
 #include <vector>
+#include <array>
+#include <string>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
 #include <algorithm>
 
 #include "maths/vec.h"
+#include "EnvImage.h"
+#include "util/AtomicFile.h"
 
 
 struct HDREnvironment
 {
 	int xres = 0;
 	int yres = 0;
-	std::vector<vec3f> data;
+	EnvImage image; // Lat-long texels, float or packed
 
-	bool isLoaded() const noexcept { return !data.empty(); }
+	// Piecewise constant distribution over the texel cells for importance sampling, proportional to luminance * sin(theta).
+	// Cell (i, j) spans texel coordinates [i, i+1) x [j, j+1), over which the bilinear lookup blends the 4 corner texels.
+	MappedArray<float> conditional_cdf; // Per row CDF over the columns, yres rows of xres + 1 entries
+	MappedArray<float> marginal_cdf;    // CDF over the rows, yres + 1 entries
+	MappedArray<float> cell_weight;     // Unnormalised weight of each cell
+	double total_weight = 0;
 
-	vec3f sample(const vec3r & direction) const noexcept
+	// Optional cube map conversion with a mip chain, avoids the trig in the lat-long lookup.
+	// Each face is stored with a 1 texel border copied from the neighbouring faces, so bilinear taps never cross faces.
+	int cube_res = 0;                          // Face resolution of the top mip level, zero if no cube map was built
+	std::vector<EnvImage> cube_mips;           // Per mip level, 6 faces of (res + 2)^2 texels stacked vertically in +x -x +y -y +z -z order
+	int rough_lod = 0;                         // Mip level used for lighting after diffuse bounces
+
+	// Irradiance as order 2 spherical harmonics (Ramamoorthi and Hanrahan 2001), for unshadowed ambient light on diffuse surfaces.
+	// The coefficients of the radiance are already convolved with the clamped cosine.
+	vec3f irradiance_sh[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	MappedFile cache_file; // Backing memory of all the arrays above when loaded from a cache
+
+	bool isLoaded() const noexcept { return !image.empty(); }
+
+	vec3f sample(const vec3r & direction, const int lod = 0) const noexcept
+	{
+		return cube_mips.empty() ? sampleLatLong(direction) : sampleCube(direction, lod);
+	}
+
+	vec3f sampleLatLong(const vec3r & direction) const noexcept
 	{
 		const real theta = std::atan2(direction.z(), direction.x()) + two_pi;
 		const real phi = std::acos(std::max((real)-1, std::min((real)1, direction.y())));
@@ -29,9 +60,450 @@ struct HDREnvironment
 		const float fv = (float)(v - v0);
 
 		return
-			data[v0 * xres + u0] * ((1 - fu) * (1 - fv)) +
-			data[v0 * xres + u1] * ((    fu) * (1 - fv)) +
-			data[v1 * xres + u0] * ((1 - fu) * (    fv)) +
-			data[v1 * xres + u1] * ((    fu) * (    fv));
+			image.get(u0, v0) * ((1 - fu) * (1 - fv)) +
+			image.get(u1, v0) * ((    fu) * (1 - fv)) +
+			image.get(u0, v1) * ((1 - fu) * (    fv)) +
+			image.get(u1, v1) * ((    fu) * (    fv));
+	}
+
+	// Cube map face resolution for a requested one (zero for a quarter of the equator resolution), rounded down to a power of two
+	//  so the mip chain goes down to 1x1
+	static int cubeMapResolution(const int requested_res, const int lat_long_xres) noexcept
+	{
+		const int target_res = (requested_res > 0) ? requested_res : std::max(1, lat_long_xres / 4);
+		int face_res = 1;
+		while (face_res * 2 <= target_res) face_res *= 2;
+		return face_res;
+	}
+
+	// Resample the lat-long map into a cube map with a box filtered mip chain down to 1x1 faces, in the same storage format
+	void buildCubeMap(const int face_res)
+	{
+		cube_res = face_res;
+		cube_mips.clear();
+
+		// Top level is resampled from the lat-long map at each texel centre
+		cube_mips.emplace_back();
+		cube_mips[0].resize(face_res + 2, 6 * (face_res + 2), image.packed);
+		EnvImage & top = cube_mips[0];
+
+		#pragma omp parallel for
+		for (int f = 0; f < 6; ++f)
+		for (int j = 0; j < face_res; ++j)
+		for (int i = 0; i < face_res; ++i)
+			top.set(i + 1, f * (face_res + 2) + j + 1, sampleLatLong(normalise(cubeDirection(f, (i + 0.5f) / face_res, (j + 0.5f) / face_res))));
+		fillCubeBorders(0);
+
+		for (int level = 1, res = face_res / 2; res > 0; ++level, res /= 2)
+		{
+			cube_mips.emplace_back();
+			cube_mips[level].resize(res + 2, 6 * (res + 2), image.packed);
+			const EnvImage & src = cube_mips[level - 1];
+			EnvImage & dst = cube_mips[level];
+
+			#pragma omp parallel for
+			for (int fj = 0; fj < 6 * res; ++fj)
+			for (int i = 0; i < res; ++i)
+			{
+				const int f = fj / res, j = fj % res;
+				const int sx = i * 2 + 1, sy = f * (res * 2 + 2) + j * 2 + 1;
+				dst.set(i + 1, f * (res + 2) + j + 1, (
+					src.get(sx, sy    ) + src.get(sx + 1, sy    ) +
+					src.get(sx, sy + 1) + src.get(sx + 1, sy + 1)) * 0.25f);
+			}
+			fillCubeBorders(level);
+		}
+	}
+
+	// Memory used by the texels of the lat-long map and cube map
+	size_t memoryUsage() const noexcept
+	{
+		size_t bytes = image.memoryUsage();
+		for (const EnvImage & mip : cube_mips)
+			bytes += mip.memoryUsage();
+		return bytes;
+	}
+
+	vec3f sampleCube(const vec3r & direction, const int lod) const noexcept
+	{
+		const int level = std::max(0, std::min((int)cube_mips.size() - 1, lod));
+		const int res = cube_res >> level;
+
+		// Select the face by the major axis, then project onto it
+		int face; float s, t;
+		cubeFace(vec3f((float)direction.x(), (float)direction.y(), (float)direction.z()), face, s, t);
+
+		// Texel coordinates including the border, with padded texel k centred at integer k
+		const float u = s * res + 0.5f;
+		const float v = t * res + 0.5f;
+		const int u0 = std::max(0, std::min(res, (int)u));
+		const int v0 = std::max(0, std::min(res, (int)v));
+		const float fu = std::max(0.0f, std::min(1.0f, u - u0));
+		const float fv = std::max(0.0f, std::min(1.0f, v - v0));
+
+		return cube_mips[level].bilinear(u0, face * (res + 2) + v0, fu, fv);
+	}
+
+	// Build the importance sampling distribution, needs to be called once after loading
+	void buildDistribution()
+	{
+		cell_weight.resize(xres * yres);
+		conditional_cdf.resize(yres * (xres + 1));
+		marginal_cdf.resize(yres + 1);
+
+		std::vector<double> row_weight(yres);
+
+		#pragma omp parallel for
+		for (int j = 0; j < yres; ++j)
+		{
+			const int j1 = (j + 1 < yres) ? j + 1 : 0;
+			const float sin_theta = (float)std::sin((j + 0.5) * pi / yres);
+
+			double sum = 0;
+			float * const cdf = &conditional_cdf[j * (xres + 1)];
+			cdf[0] = 0;
+			for (int i = 0; i < xres; ++i)
+			{
+				const int i1 = (i + 1 < xres) ? i + 1 : 0;
+
+				// The integral of the bilinear interpolant over the cell is the average of the corners,
+				//  so cells only get zero weight when the lookup is zero everywhere inside them
+				const float lum =
+					luminance(image.get(i, j )) + luminance(image.get(i1, j )) +
+					luminance(image.get(i, j1)) + luminance(image.get(i1, j1));
+				const float w = std::max(0.0f, lum * 0.25f * sin_theta);
+
+				cell_weight[j * xres + i] = w;
+				sum += w;
+				cdf[i + 1] = (float)sum;
+			}
+
+			const float inv_sum = (sum > 0) ? (float)(1 / sum) : 0;
+			for (int i = 1; i <= xres; ++i)
+				cdf[i] = (sum > 0) ? cdf[i] * inv_sum : i / (float)xres;
+			row_weight[j] = sum;
+		}
+
+		double sum = 0;
+		marginal_cdf[0] = 0;
+		for (int j = 0; j < yres; ++j)
+		{
+			sum += row_weight[j];
+			marginal_cdf[j + 1] = (float)sum;
+		}
+		for (int j = 1; j <= yres; ++j)
+			marginal_cdf[j] = (sum > 0) ? (float)(marginal_cdf[j] / sum) : j / (float)yres;
+		total_weight = sum;
+	}
+
+	// Project the map onto the SH basis and convolve with the clamped cosine, needs to be called once after loading
+	void buildIrradianceSH()
+	{
+		// Integrate over the same cells as the sampling distribution, each the average of its 4 corner texels
+		std::vector<std::array<double, 27>> row_sums(yres);
+
+		#pragma omp parallel for
+		for (int j = 0; j < yres; ++j)
+		{
+			const int j1 = (j + 1 < yres) ? j + 1 : 0;
+			const real phi = (j + 0.5) * (pi / yres);
+			const real sin_phi = std::sin(phi), cos_phi = std::cos(phi);
+			const real d_omega = sin_phi * (pi / yres) * (two_pi / xres);
+
+			std::array<double, 27> & sums = row_sums[j];
+			sums.fill(0);
+			for (int i = 0; i < xres; ++i)
+			{
+				const int i1 = (i + 1 < xres) ? i + 1 : 0;
+				const vec3f c = (image.get(i, j) + image.get(i1, j) + image.get(i, j1) + image.get(i1, j1)) * 0.25f;
+
+				const real a = (i + 0.5) * (two_pi / xres) - pi_half;
+				const vec3r d = { sin_phi * std::cos(a), cos_phi, sin_phi * std::sin(a) };
+
+				real basis[9];
+				shBasis(d, basis);
+				for (int k = 0; k < 9; ++k)
+				for (int ch = 0; ch < 3; ++ch)
+					sums[k * 3 + ch] += c.e[ch] * basis[k] * d_omega;
+			}
+		}
+
+		// Clamped cosine convolution scales each band, see eq. 8 of the paper
+		const real band_scale[9] = { pi, two_pi / 3, two_pi / 3, two_pi / 3, pi / 4, pi / 4, pi / 4, pi / 4, pi / 4 };
+		for (int k = 0; k < 9; ++k)
+		for (int ch = 0; ch < 3; ++ch)
+		{
+			double sum = 0;
+			for (int j = 0; j < yres; ++j)
+				sum += row_sums[j][k * 3 + ch];
+			irradiance_sh[k].e[ch] = (float)(sum * band_scale[k]);
+		}
+	}
+
+	// Unshadowed irradiance arriving at a surface with the given normal
+	vec3f irradiance(const vec3r & normal) const noexcept
+	{
+		real basis[9];
+		shBasis(normal, basis);
+
+		vec3f e = 0;
+		for (int k = 0; k < 9; ++k)
+			e += irradiance_sh[k] * (float)basis[k];
+		return { std::max(0.0f, e.x()), std::max(0.0f, e.y()), std::max(0.0f, e.z()) }; // Ringing can go slightly negative
+	}
+
+	// Write the texels, sampling distribution and cube map to a binary cache file, which mapCache() can use without copying.
+	// The source stamp identifies the file the cache was made from, so that stale caches get rebuilt.
+	bool writeCache(const std::string & path, const uint64_t source_stamp) const
+	{
+		std::vector<std::pair<const void *, size_t>> sections =
+		{
+			{ image.bytes(), image.byteSize() },
+			{ cell_weight.data(),     cell_weight.size()     * sizeof(float) },
+			{ conditional_cdf.data(), conditional_cdf.size() * sizeof(float) },
+			{ marginal_cdf.data(),    marginal_cdf.size()    * sizeof(float) }
+		};
+		for (const EnvImage & mip : cube_mips)
+			sections.push_back({ mip.bytes(), mip.byteSize() });
+
+		// Write to a temporary file of our own and move it into place, so concurrent renders never see a partial cache
+		const std::string temp_path = atomicTempPath(path);
+		FILE * const f = fopen(temp_path.c_str(), "wb");
+		if (f == nullptr)
+			return false;
+
+		CacheHeader header = { { 'F', 'T', 'E', 'N', 'V', '0', '0', '2' }, source_stamp,
+			xres, yres, image.packed ? 1 : 0, cube_res, (int32_t)cube_mips.size(), 0, total_weight, { 0 } };
+		for (int k = 0; k < 9 * 3; ++k)
+			header.irradiance_sh[k] = irradiance_sh[k / 3].e[k % 3];
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+		const char zeros[cache_alignment] = { 0 };
+		size_t offset = sizeof(header);
+		for (const auto & [ptr, bytes] : sections)
+		{
+			const size_t padding = cacheAlign(offset) - offset;
+			ok = ok && fwrite(zeros, 1, padding, f) == padding && fwrite(ptr, 1, bytes, f) == bytes;
+			offset = cacheAlign(offset) + bytes;
+		}
+		ok = (fclose(f) == 0) && ok;
+
+		if (!ok)
+		{
+			std::remove(temp_path.c_str());
+			return false;
+		}
+		return atomicReplace(temp_path, path);
+	}
+
+	// Memory map a cache written by writeCache(), returns false if it's missing, stale or made with different settings.
+	// The requested cube map resolution is as for cubeMapResolution(), or negative for no cube map.
+	bool mapCache(const std::string & path, const uint64_t source_stamp, const bool packed, const int requested_cube_res)
+	{
+		if (!cache_file.open(path) || cache_file.size < sizeof(CacheHeader))
+			return false;
+
+		CacheHeader header;
+		std::memcpy(&header, cache_file.data, sizeof(header));
+		if (std::memcmp(header.magic, "FTENV002", 8) != 0 || header.source_stamp != source_stamp ||
+			header.packed != (packed ? 1 : 0) || header.xres <= 0 || header.yres <= 0 ||
+			header.cube_res != ((requested_cube_res < 0) ? 0 : cubeMapResolution(requested_cube_res, header.xres)))
+		{
+			cache_file.close();
+			return false;
+		}
+
+		xres = header.xres;
+		yres = header.yres;
+		cube_res = header.cube_res;
+		total_weight = header.total_weight;
+		for (int k = 0; k < 9 * 3; ++k)
+			irradiance_sh[k / 3].e[k % 3] = header.irradiance_sh[k];
+
+		// Point the arrays at their sections in the order they were written, the sizes follow from the header.
+		// Nothing is read yet, so the bounds are only checked at the end.
+		size_t offset = sizeof(header);
+		const auto section = [&]() { offset = cacheAlign(offset); return cache_file.data + offset; };
+
+		image.map(xres, yres, packed, section());
+		offset += image.byteSize();
+		const auto map_floats = [&](MappedArray<float> & array, const size_t count) { array.map((const float *)section(), count); offset += count * sizeof(float); };
+		map_floats(cell_weight, (size_t)xres * yres);
+		map_floats(conditional_cdf, (size_t)yres * (xres + 1));
+		map_floats(marginal_cdf, (size_t)yres + 1);
+
+		cube_mips.clear();
+		for (int level = 0; level < header.num_mips; ++level)
+		{
+			const int res = cube_res >> level;
+			cube_mips.emplace_back();
+			cube_mips[level].map(res + 2, 6 * (res + 2), packed, section());
+			offset += cube_mips[level].byteSize();
+		}
+
+		if (offset > cache_file.size)
+		{
+			unload(); // Truncated file
+			return false;
+		}
+		return true;
+	}
+
+	void unload() noexcept
+	{
+		xres = yres = cube_res = 0;
+		total_weight = 0;
+		for (vec3f & c : irradiance_sh) c = 0;
+		image.map(0, 0, false, nullptr);
+		cell_weight.clear();
+		conditional_cdf.clear();
+		marginal_cdf.clear();
+		cube_mips.clear();
+		cache_file.close();
+	}
+
+	// Importance sample a direction, returns the solid angle pdf (zero if the sample should be discarded)
+	real sampleDirection(const vec2r & u, vec3r & dir_out) const noexcept
+	{
+		if (total_weight <= 0)
+			return 0;
+
+		// Sample a row from the marginal distribution, then a column from that row's conditional distribution
+		const int j = sampleCDF(&marginal_cdf[0], yres, (float)u.y());
+		const float * const cdf = &conditional_cdf[j * (xres + 1)];
+		const int i = sampleCDF(cdf, xres, (float)u.x());
+
+		// Uniform position within the cell, reusing the remaining precision of the random numbers
+		const float du = (float)(u.x() - cdf[i]) / std::max(1e-20f, cdf[i + 1] - cdf[i]);
+		const float dv = (float)(u.y() - marginal_cdf[j]) / std::max(1e-20f, marginal_cdf[j + 1] - marginal_cdf[j]);
+		const real tex_u = i + std::min(du, FloatOneMinusEpsilon);
+		const real tex_v = j + std::min(dv, FloatOneMinusEpsilon);
+
+		// Invert the mapping used in sample()
+		const real phi = tex_v * (pi / yres);
+		const real a   = tex_u * (two_pi / xres) - pi_half;
+		const real sin_phi = std::sin(phi);
+		if (sin_phi <= 0)
+			return 0;
+
+		dir_out = { sin_phi * std::cos(a), std::cos(phi), sin_phi * std::sin(a) };
+
+		return cellPdf(i, j) / sin_phi;
+	}
+
+	// Solid angle pdf of sampleDirection generating the given direction
+	real directionPdf(const vec3r & direction) const noexcept
+	{
+		if (total_weight <= 0)
+			return 0;
+
+		const real theta = std::atan2(direction.z(), direction.x()) + two_pi;
+		const real phi = std::acos(std::max((real)-1, std::min((real)1, direction.y())));
+		const real sin_phi = std::sin(phi);
+		if (sin_phi <= 0)
+			return 0;
+
+		const int i = std::min(xres - 1, (int)std::fmod((theta + pi_half) * (xres / two_pi), (real)xres));
+		const int j = std::min(yres - 1, (int)(phi * (yres / pi)));
+
+		return cellPdf(i, j) / sin_phi;
+	}
+
+private:
+	static constexpr size_t cache_alignment = 64;
+	static size_t cacheAlign(const size_t offset) noexcept { return (offset + cache_alignment - 1) & ~(cache_alignment - 1); }
+
+	struct CacheHeader
+	{
+		char magic[8];
+		uint64_t source_stamp;
+		int32_t xres, yres, packed, cube_res, num_mips, padding;
+		double total_weight;
+		float irradiance_sh[9 * 3];
+	};
+
+	// Real SH basis functions up to band 2, in the order (0,0) (1,-1) (1,0) (1,1) (2,-2) (2,-1) (2,0) (2,1) (2,2)
+	static void shBasis(const vec3r & d, real basis[9]) noexcept
+	{
+		const real x = d.x(), y = d.y(), z = d.z();
+		basis[0] = 0.282095f;
+		basis[1] = 0.488603f * y;
+		basis[2] = 0.488603f * z;
+		basis[3] = 0.488603f * x;
+		basis[4] = 1.092548f * x * y;
+		basis[5] = 1.092548f * y * z;
+		basis[6] = 0.315392f * (3 * z * z - 1);
+		basis[7] = 1.092548f * x * z;
+		basis[8] = 0.546274f * (x * x - y * y);
+	}
+
+	// Face index and [0, 1] face coordinates of a direction, using only compares and a single divide
+	static void cubeFace(const vec3f & d, int & face, float & s, float & t) noexcept
+	{
+		const float ax = std::fabs(d.x()), ay = std::fabs(d.y()), az = std::fabs(d.z());
+		float ma, sc, tc;
+		if (ax >= ay && ax >= az) { face = (d.x() < 0) ? 1 : 0; ma = ax; sc = (d.x() < 0) ?  d.z() : -d.z(); tc = -d.y(); }
+		else if (ay >= az)        { face = (d.y() < 0) ? 3 : 2; ma = ay; sc =  d.x(); tc = (d.y() < 0) ? -d.z() :  d.z(); }
+		else                      { face = (d.z() < 0) ? 5 : 4; ma = az; sc = (d.z() < 0) ? -d.x() :  d.x(); tc = -d.y(); }
+
+		const float inv_ma = 0.5f / std::max(ma, 1e-20f);
+		s = sc * inv_ma + 0.5f;
+		t = tc * inv_ma + 0.5f;
+	}
+
+	// Inverse of cubeFace, (not normalised) direction through face coordinates (s, t)
+	static vec3r cubeDirection(const int face, const float s, const float t) noexcept
+	{
+		const real sc = s * 2 - 1, tc = t * 2 - 1;
+		switch (face)
+		{
+			case 0:  return { 1, -tc, -sc };
+			case 1:  return { -1, -tc, sc };
+			case 2:  return { sc, 1, tc };
+			case 3:  return { sc, -1, -tc };
+			case 4:  return { sc, -tc, 1 };
+			default: return { -sc, -tc, -1 };
+		}
+	}
+
+	// Copy the nearest texels of the adjacent faces into the border of each face of a mip level
+	void fillCubeBorders(const int level) noexcept
+	{
+		const int res = cube_res >> level;
+		const int stride = res + 2;
+		EnvImage & texels = cube_mips[level];
+
+		// Borders are only read from the face interiors, so the faces can be done in parallel
+		#pragma omp parallel for
+		for (int f = 0; f < 6; ++f)
+		for (int j = -1; j <= res; ++j)
+		for (int i = -1; i <= res; ++i)
+		{
+			if (i >= 0 && i < res && j >= 0 && j < res)
+				continue;
+
+			// Direction through the border texel centre lands on a neighbouring face (or this face for the corners)
+			const vec3r d = cubeDirection(f, (i + 0.5f) / res, (j + 0.5f) / res);
+			int face; float s, t;
+			cubeFace(vec3f((float)d.x(), (float)d.y(), (float)d.z()), face, s, t);
+			const int si = std::max(0, std::min(res - 1, (int)(s * res)));
+			const int sj = std::max(0, std::min(res - 1, (int)(t * res)));
+			texels.set(i + 1, f * stride + j + 1, texels.get(si + 1, face * stride + sj + 1));
+		}
+	}
+
+	// Find the interval in a normalised CDF with n + 1 entries containing u
+	static int sampleCDF(const float * cdf, const int n, const float u) noexcept
+	{
+		const int i = (int)(std::upper_bound(cdf, cdf + n + 1, u) - cdf) - 1;
+		return std::max(0, std::min(n - 1, i));
+	}
+
+	// Pdf with respect to solid angle of a cell, without the 1 / sin(theta) factor
+	real cellPdf(const int i, const int j) const noexcept
+	{
+		// Uniform within the cell in texel space, which maps to 2 pi * pi in spherical coordinates
+		const real texel_pdf = cell_weight[j * xres + i] * ((real)xres * yres / total_weight);
+		return texel_pdf * (1 / (two_pi * pi));
 	}
 };
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "maths/vec.h"
+#include "util/RelaxedAtomic.h"
+
+
+// Online path guiding in the style of "Practical Path Guiding for Efficient Light-Transport Simulation" (Müller et al. 2017):
+//  a spatial binary tree over the scene whose leaves hold directional quadtrees of incident radiance.
+// Each leaf has a tree that is sampled during the current iteration and one that is trained, which replaces it at the next refresh.
+// Training is lock-free: render threads buffer records per bucket and splat them with atomic adds, the tree structure only
+//  changes in refresh(), between passes.
+
+
+// Vertex of a guided path, recorded once the radiance arriving along the sampled direction is known
+struct GuidingRecord
+{
+	vec3f position;
+	vec3f direction;
+	float radiance; // Luminance of the incident radiance estimate, times the cosine to the surface normal
+	float pdf;      // Solid angle pdf the direction was sampled with
+};
+
+
+// Quadtree over the square [0, 1]^2, which is mapped to the sphere with the equal-area cylindrical mapping (cos theta, phi)
+struct DirectionalQuadtree
+{
+	// Child cell c = x + 2y covers [x, x + 1] * 0.5 by [y, y + 1] * 0.5 of the node, child index zero means leaf cell
+	struct Node
+	{
+		RelaxedAtomic<float> sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		int child[4] = { 0, 0, 0, 0 };
+	};
+
+	std::vector<Node> nodes = std::vector<Node>(1);
+	RelaxedAtomic<int64_t> num_samples = 0; // Number of deposits, the mean deposit estimates the cosine-weighted irradiance
+
+	float total() const noexcept { return nodes[0].sum[0] + nodes[0].sum[1] + nodes[0].sum[2] + nodes[0].sum[3]; }
+
+	static vec2f toSquare(const vec3f & d) noexcept
+	{
+		const float cos_theta = std::max(-1.0f, std::min(1.0f, d.z()));
+		float phi = std::atan2(d.y(), d.x()) * (float)(1 / two_pi);
+		if (phi < 0) phi += 1;
+		return { (cos_theta + 1) * 0.5f, std::min(phi, FloatOneMinusEpsilon) };
+	}
+
+	static vec3f toDirection(const vec2f & p) noexcept
+	{
+		const float cos_theta = 2 * p.x() - 1;
+		const float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+		const float phi = (float)two_pi * p.y();
+		return { std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta };
+	}
+
+	// Accumulate a radiance estimate in every node containing the direction, safe to call concurrently
+	void deposit(const vec3f & direction, const float value) noexcept
+	{
+		vec2f p = toSquare(direction);
+		int n = 0;
+		while (true)
+		{
+			const int cx = (p.x() >= 0.5f) ? 1 : 0;
+			const int cy = (p.y() >= 0.5f) ? 1 : 0;
+			const int c = cx + 2 * cy;
+
+			nodes[n].sum[c].add(value);
+
+			if (nodes[n].child[c] == 0)
+				break;
+			n = nodes[n].child[c];
+			p = { p.x() * 2 - cx, p.y() * 2 - cy };
+		}
+	}
+
+	// Solid angle pdf of sample(), zero if there's no data
+	float pdf(const vec3f & direction) const noexcept
+	{
+		const float root_total = total();
+		if (!(root_total > 0))
+			return 0;
+
+		vec2f p = toSquare(direction);
+		float density = 1;
+		int n = 0;
+		while (true)
+		{
+			const Node & node = nodes[n];
+			const int cx = (p.x() >= 0.5f) ? 1 : 0;
+			const int cy = (p.y() >= 0.5f) ? 1 : 0;
+			const int c = cx + 2 * cy;
+
+			const float node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+			if (!(node.sum[c] > 0))
+				return 0;
+			density *= 4 * node.sum[c] / node_total;
+
+			if (node.child[c] == 0)
+				break;
+			n = node.child[c];
+			p = { p.x() * 2 - cx, p.y() * 2 - cy };
+		}
+		return density * (float)(1 / (4 * pi));
+	}
+
+	// Sample a direction proportional to the learned radiance, choosing the row then the column at each level
+	vec3f sample(vec2f u) const noexcept
+	{
+		vec2f origin = { 0, 0 };
+		float size = 1;
+		int n = 0;
+		while (true)
+		{
+			const Node & node = nodes[n];
+			const float bottom = node.sum[0] + node.sum[1];
+			const float top    = node.sum[2] + node.sum[3];
+
+			int cy = 0;
+			const float p_bottom = bottom / (bottom + top);
+			if (u.y() < p_bottom) u.y() = u.y() / p_bottom;
+			else { cy = 1; u.y() = (u.y() - p_bottom) / (1 - p_bottom); }
+
+			int cx = 0;
+			const float row_total = node.sum[2 * cy] + node.sum[2 * cy + 1];
+			const float p_left = node.sum[2 * cy] / row_total;
+			if (u.x() < p_left) u.x() = u.x() / p_left;
+			else { cx = 1; u.x() = (u.x() - p_left) / (1 - p_left); }
+
+			size *= 0.5f;
+			origin += vec2f(cx * size, cy * size);
+
+			const int c = cx + 2 * cy;
+			if (node.child[c] == 0)
+				break;
+			n = node.child[c];
+		}
+
+		const vec2f p =
+		{
+			origin.x() + size * std::min(std::max(u.x(), 0.0f), FloatOneMinusEpsilon),
+			origin.y() + size * std::min(std::max(u.y(), 0.0f), FloatOneMinusEpsilon)
+		};
+		return toDirection(p);
+	}
+
+	// Empty tree whose structure adapts to this one: cells with more than a fraction rho of the energy are subdivided,
+	//  subtrees below that are collapsed
+	DirectionalQuadtree refined(const float rho, const int max_depth) const
+	{
+		DirectionalQuadtree result;
+		const float root_total = total();
+		if (!(root_total > 0))
+			return result;
+
+		struct Item { int old_node; int new_node; int depth; float fraction[4]; };
+		std::vector<Item> stack;
+
+		const auto push_node = [&](const int old_node, const int new_node, const int depth, const float parent_fraction)
+		{
+			Item item = { old_node, new_node, depth, { 0, 0, 0, 0 } };
+			if (old_node >= 0)
+			{
+				const Node & node = nodes[old_node];
+				const float node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+				for (int c = 0; c < 4; ++c)
+					item.fraction[c] = (node_total > 0) ? parent_fraction * node.sum[c] / node_total : parent_fraction * 0.25f;
+			}
+			else
+			{
+				// Cell that was a leaf in the old tree, assume its energy is spread evenly
+				for (int c = 0; c < 4; ++c)
+					item.fraction[c] = parent_fraction * 0.25f;
+			}
+			stack.push_back(item);
+		};
+
+		push_node(0, 0, 1, 1);
+		while (!stack.empty())
+		{
+			const Item item = stack.back();
+			stack.pop_back();
+
+			for (int c = 0; c < 4; ++c)
+			{
+				if (item.fraction[c] <= rho || item.depth >= max_depth)
+					continue;
+
+				const int new_child = (int)result.nodes.size();
+				result.nodes.emplace_back();
+				result.nodes[item.new_node].child[c] = new_child;
+
+				const int old_child = (item.old_node >= 0 && nodes[item.old_node].child[c] != 0) ? nodes[item.old_node].child[c] : -1;
+				push_node(old_child, new_child, item.depth + 1, item.fraction[c]);
+			}
+		}
+		return result;
+	}
+};
+
+
+struct PathGuiding
+{
+	float sampling_fraction = 0.5f; // Probability of sampling the guiding distribution rather than the cosine lobe
+	float rho = 0.01f;              // Energy fraction above which directional cells are subdivided
+	int max_directional_depth = 20;
+	int spatial_threshold = 12000;  // Scaled by sqrt(2^iteration), leaves with more records than this get split
+	int max_spatial_depth = 24;
+
+	PathGuiding(const vec3f & bounds_min_, const vec3f & bounds_max_) noexcept : bounds_min(bounds_min_), bounds_max(bounds_max_)
+	{
+		nodes.emplace_back();
+		leaves.emplace_back();
+	}
+
+	// Directional distribution to sample at a position, or nullptr if nothing was learned there yet
+	const DirectionalQuadtree * samplingTree(const vec3r & position) const noexcept
+	{
+		const Leaf & leaf = leaves[findLeaf(position)];
+		return (leaf.sampling.total() > 0) ? &leaf.sampling : nullptr;
+	}
+
+	// Irradiance estimate from the learned distribution at a position, zero if nothing was learned there yet
+	float irradiance(const vec3r & position) const noexcept
+	{
+		const DirectionalQuadtree & tree = leaves[findLeaf(position)].sampling;
+		return (tree.num_samples > 0) ? tree.total() / tree.num_samples : 0;
+	}
+
+	// Splat the records into the training trees, safe to call from multiple render threads
+	void deposit(const std::vector<GuidingRecord> & records) noexcept
+	{
+		for (const GuidingRecord & r : records)
+		{
+			if (!(r.radiance >= 0 && r.pdf > 0) || !std::isfinite(r.radiance / r.pdf))
+				continue;
+
+			// Paths that gathered nothing still count towards the mean, but leave the distribution unchanged
+			Leaf & leaf = leaves[findLeaf(vec3r(r.position.x(), r.position.y(), r.position.z()))];
+			if (r.radiance > 0)
+				leaf.training.deposit(r.direction, r.radiance / r.pdf);
+
+			leaf.num_records.add(1);
+			leaf.training.num_samples.add(1);
+		}
+	}
+
+	// Start a new training iteration: refine the spatial tree, sample from what was just learned, and adapt the training trees
+	void refresh()
+	{
+		const int64_t threshold = (int64_t)(spatial_threshold * std::sqrt((double)(1 << std::min(iteration, 30))));
+		for (int n = 0; n < (int)nodes.size(); ++n) // Note that the node array grows during the loop
+			if (nodes[n].leaf >= 0 && leaves[nodes[n].leaf].num_records > threshold && nodes[n].depth < max_spatial_depth)
+				splitLeaf(n);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < (int)leaves.size(); ++i)
+		{
+			Leaf & leaf = leaves[i];
+			if (leaf.training.total() > 0)
+			{
+				leaf.sampling = std::move(leaf.training);
+				leaf.training = leaf.sampling.refined(rho, max_directional_depth);
+			}
+			leaf.num_records = 0;
+		}
+		++iteration;
+	}
+
+	int numLeaves() const noexcept { return (int)leaves.size(); }
+
+private:
+	struct SpatialNode
+	{
+		int child[2] = { 0, 0 };
+		int axis  = 0;
+		int depth = 0;
+		int leaf  = 0; // Index into the leaves for leaf nodes, -1 for inner nodes
+	};
+
+	struct Leaf
+	{
+		DirectionalQuadtree sampling;
+		DirectionalQuadtree training;
+		RelaxedAtomic<int64_t> num_records = 0;
+	};
+
+	vec3f bounds_min, bounds_max;
+	std::vector<SpatialNode> nodes;
+	std::vector<Leaf> leaves;
+	int iteration = 0;
+
+	int findLeaf(const vec3r & position) const noexcept
+	{
+		// Normalise to the unit cube, clamping positions outside the bounds to the boundary leaves
+		float p[3];
+		for (int i = 0; i < 3; ++i)
+			p[i] = std::max(0.0f, std::min(FloatOneMinusEpsilon, ((float)position.e[i] - bounds_min.e[i]) / (bounds_max.e[i] - bounds_min.e[i])));
+
+		int n = 0;
+		while (nodes[n].leaf < 0)
+		{
+			const SpatialNode & node = nodes[n];
+			const int c = (p[node.axis] >= 0.5f) ? 1 : 0;
+			p[node.axis] = p[node.axis] * 2 - c;
+			n = node.child[c];
+		}
+		return nodes[n].leaf;
+	}
+
+	// Split a leaf in half along its axis, the children inherit its distributions and half its records each
+	void splitLeaf(const int n)
+	{
+		const int leaf = nodes[n].leaf;
+		const int axis = nodes[n].axis;
+		const int depth = nodes[n].depth;
+		leaves[leaf].num_records = leaves[leaf].num_records / 2;
+
+		const int new_leaf = (int)leaves.size();
+		Leaf copy = leaves[leaf];
+		leaves.push_back(std::move(copy));
+
+		for (int c = 0; c < 2; ++c)
+		{
+			SpatialNode child;
+			child.axis  = (axis + 1) % 3;
+			child.depth = depth + 1;
+			child.leaf  = (c == 0) ? leaf : new_leaf;
+			nodes[n].child[c] = (int)nodes.size();
+			nodes.push_back(child);
+		}
+		nodes[n].leaf = -1;
+	}
+};
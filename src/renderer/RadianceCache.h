@@ -0,0 +1,117 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "maths/vec.h"
+#include "util/RelaxedAtomic.h"
+
+
+// World-space radiance cache in a hashed grid (in the style of Binder et al. 2019, "Massively Parallel Path Space Filtering").
+// Each cell is keyed by a quantised position and the dominant axis of the surface normal, and averages the reflected
+//  irradiance / pi that paths gathered at diffuse vertices inside it, excluding direct lighting at the vertex itself.
+// Paths that reach a cell with enough samples can stop there and take the cached value instead of bouncing further.
+// The bias is controlled by the cell size, the minimum number of samples before a cell is used and the first bounce that
+//  looks it up, since the blur of the cache is much less visible after a diffuse bounce than at the first hit.
+struct RadianceCache
+{
+	float cell_size   = 1.0f / 64; // World-space size of a grid cell
+	int   min_samples = 32;        // Cells with fewer samples than this aren't used
+	int   min_bounce  = 2;         // Earliest path vertex that may terminate in the cache, the first hit is 1
+
+	RadianceCache(const int log2_capacity = 20) : cells(size_t(1) << log2_capacity), mask((uint64_t(1) << log2_capacity) - 1) { }
+
+	// Add an estimate of the reflected irradiance / pi at a surface point, safe to call concurrently
+	void deposit(const vec3r & position, const vec3r & normal, const vec3f & value) noexcept
+	{
+		Cell * const cell = findCell(key(position, normal), true);
+		if (cell == nullptr)
+			return;
+
+		for (int c = 0; c < 3; ++c)
+			cell->sum[c].add(value.e[c]);
+		cell->count.add(1);
+	}
+
+	// Get the cached reflected irradiance / pi at a surface point, returns false if the cell doesn't have enough samples yet
+	bool lookup(const vec3r & position, const vec3r & normal, vec3f & value) const noexcept
+	{
+		const Cell * const cell = const_cast<RadianceCache *>(this)->findCell(key(position, normal), false);
+		if (cell == nullptr)
+			return false;
+
+		const uint32_t count = cell->count;
+		if (count < (uint32_t)min_samples)
+			return false;
+
+		for (int c = 0; c < 3; ++c)
+			value.e[c] = cell->sum[c];
+		value *= 1.0f / count;
+		return true;
+	}
+
+	void clear() noexcept
+	{
+		for (Cell & cell : cells)
+		{
+			cell.key.store(0, std::memory_order_relaxed);
+			for (int c = 0; c < 3; ++c)
+				cell.sum[c] = 0.0f;
+			cell.count = 0;
+		}
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<uint64_t> key { 0 }; // Zero for empty cells
+		RelaxedAtomic<float> sum[3] = { 0.0f, 0.0f, 0.0f };
+		RelaxedAtomic<uint32_t> count = 0;
+	};
+
+	static constexpr int max_probes = 8;
+
+	std::vector<Cell> cells;
+	const uint64_t mask;
+
+	// 20 bits per position axis (wrapping around far away) and 3 bits for the normal's dominant axis and sign, the top bit marks it valid
+	uint64_t key(const vec3r & position, const vec3r & normal) const noexcept
+	{
+		uint64_t k = uint64_t(1) << 63;
+		for (int i = 0; i < 3; ++i)
+			k |= (uint64_t)((int64_t)std::floor(position.e[i] / cell_size) & 0xFFFFF) << (20 * i);
+
+		const real ax = std::fabs(normal.x()), ay = std::fabs(normal.y()), az = std::fabs(normal.z());
+		const int axis = (ax >= ay && ax >= az) ? 0 : (ay >= az) ? 1 : 2;
+		return k | (uint64_t)(axis * 2 + (normal.e[axis] < 0 ? 1 : 0)) << 60;
+	}
+
+	// Linear probing, claiming an empty cell for the key if insert is set. When the neighbourhood is full the sample is dropped.
+	Cell * findCell(const uint64_t k, const bool insert) noexcept
+	{
+		// Finaliser from SplitMix64
+		uint64_t h = k;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+		h =  h ^ (h >> 31);
+
+		for (int i = 0; i < max_probes; ++i)
+		{
+			Cell & cell = cells[(h + i) & mask];
+			uint64_t cell_key = cell.key.load(std::memory_order_acquire);
+			if (cell_key == k)
+				return &cell;
+			if (cell_key == 0)
+			{
+				if (!insert)
+					return nullptr;
+				if (cell.key.compare_exchange_strong(cell_key, k, std::memory_order_acq_rel) || cell_key == k)
+					return &cell;
+			}
+		}
+		return nullptr;
+	}
+};
@@ -1,387 +1,996 @@
 #pragma once
 
 #include <atomic>
+#include <thread>
+#include <memory>
+#include <chrono>
 #include <vector>
 #include <array>
 #include <algorithm>
 
 #include "Scene.h"
 #include "HDREnvironment.h"
+#include "PathGuiding.h"
+#include "RadianceCache.h"
+#include "Sampler.h"
+#include "StartDistanceGrid.h"
+#include "maths/half.h"
 
 
 
-constexpr int noise_size = 1 << 8;
-std::array<uint16_t, noise_size * noise_size> noise_data;
+// Multiple importance sampling weight for a sample from strategy a, with power 2
+// Ref: "Optimally Combining Sampling Techniques for Monte Carlo Rendering", Veach and Guibas 1995
+inline real powerHeuristic(real pdf_a, real pdf_b) { return (pdf_a * pdf_a) / (pdf_a * pdf_a + pdf_b * pdf_b); }
 
+// Map a unit normal to [0, 1] for the normal AOV, swapping Y and Z
+inline vec3f encodeNormal(const vec3r & normal) noexcept { return vec3f{ (float)normal.x(), (float)normal.z(), (float)normal.y() } * 0.5f + 0.5f; }
 
-void HilbertFibonacci(const vec2i dx, const vec2i dy, vec2i p, int size, uint64_t & next_val)
+
+// Get rounded up number of buckets in x and y
+constexpr int bucket_size = 32;
+inline int numBuckets(const int res) noexcept { return (res + bucket_size - 1) / bucket_size; }
+
+
+// Optional per-pixel outputs besides the beauty and sample count, which are only allocated and accumulated when requested
+enum AOVFlags
+{
+	aov_normal   = 1 << 0,
+	aov_albedo   = 1 << 1,
+	aov_depth    = 1 << 2,
+	aov_variance = 1 << 3, // Sum of squared beauty luminance, for adaptive sampling, the error image and the denoiser
+	aov_half     = 1 << 4, // Keep the normal, albedo and depth as half precision running means instead of float sums
+	aov_all      = aov_normal | aov_albedo | aov_depth | aov_variance
+};
+
+
+// Accumulation buffers, stored bucket by bucket so that the pixels of a bucket are one contiguous block.
+// Index them with pixelIndex(), and read the AOVs with the accessors since they may be stored at half precision.
+struct RenderOutput
 {
-	if (size > 1)
+	const int xres, yres;
+	const int aovs;
+
+	// Where the buffers are in the whole image, which is larger when rendering it in tiles. Pixel coordinates given to the
+	//  integrators are relative to the tile, only the camera and samplers see the position in the image.
+	int x0 = 0, y0 = 0;
+	int image_xres, image_yres;
+	int pixel_scale = 1; // Size of the pixels in pixels of the image, for the coarse levels of a multi-resolution render
+
+	std::vector<vec3f> beauty;
+	std::vector<int>   samples; // Number of samples accumulated per pixel, can differ when a pass is cancelled or adaptive
+	std::vector<float> beauty_lum2; // Sum of squared beauty luminance, for the running variance estimate
+
+	// Sums of samples at full precision
+	std::vector<vec3f> normal;
+	std::vector<vec3f> albedo;
+	std::vector<float> depth; // Sum of camera ray hit distances, zero for misses
+
+	// Means of samples at half precision, which can't hold sums of many samples accurately
+	std::vector<std::array<uint16_t, 3>> normal_half, albedo_half;
+	std::vector<uint16_t> depth_half;
+
+
+	RenderOutput(int xres_, int yres_, int aovs_ = aov_all) : xres(xres_), yres(yres_), aovs(aovs_), image_xres(xres_), image_yres(yres_)
 	{
-		size >>= 1;
-		HilbertFibonacci( dy,  dx, p, size, next_val); p += dy *  size;
-		HilbertFibonacci( dx,  dy, p, size, next_val); p += dx *  size;
-		HilbertFibonacci( dx,  dy, p, size, next_val); p += dx * (size - 1) - dy;
-		HilbertFibonacci(-dy, -dx, p, size, next_val);
+		const size_t num_pixels = (size_t)xres * yres;
+		const bool half = (aovs & aov_half) != 0;
+		beauty.resize(num_pixels);
+		samples.resize(num_pixels);
+		if (aovs & aov_variance) beauty_lum2.resize(num_pixels);
+		if (aovs & aov_normal) { if (half) normal_half.resize(num_pixels); else normal.resize(num_pixels); }
+		if (aovs & aov_albedo) { if (half) albedo_half.resize(num_pixels); else albedo.resize(num_pixels); }
+		if (aovs & aov_depth)  { if (half) depth_half.resize(num_pixels);  else depth.resize(num_pixels); }
 	}
-	else
+
+	void clear()
 	{
-		next_val += 11400714819323198487ull;
-		noise_data[p.y() * noise_size + p.x()] = (uint16_t)(next_val >> 48);
+		const auto zero = [](auto & buffer) { if (!buffer.empty()) memset((void *)buffer.data(), 0, buffer.size() * sizeof(buffer[0])); };
+		zero(beauty);
+		zero(samples);
+		zero(beauty_lum2);
+		zero(normal);
+		zero(albedo);
+		zero(depth);
+		zero(normal_half);
+		zero(albedo_half);
+		zero(depth_half);
 	}
-}
 
-// From PBRT
-double RadicalInverse(int sample, int base) noexcept
-{
-	const double invBase = 1.0 / base;
+	// Buckets are stored in rows, and the pixels of each bucket in rows, with smaller buckets along the right and bottom edges
+	int pixelIndex(const int x, const int y) const noexcept
+	{
+		const int bucket_x0 = x - x % bucket_size;
+		const int bucket_y0 = y - y % bucket_size;
+		const int bucket_w = std::min(bucket_size, xres - bucket_x0);
+		const int bucket_h = std::min(bucket_size, yres - bucket_y0);
+		return bucket_y0 * xres + bucket_x0 * bucket_h + (y - bucket_y0) * bucket_w + (x - bucket_x0);
+	}
 
-	int reversedDigits = 0;
-	double invBaseN = 1;
-	while (sample)
+	// Estimated standard error of the pixel mean relative to the mean, infinite until we have enough samples
+	float relativeError(const int pixel_idx) const noexcept
 	{
-		const int next  = sample / base;
-		const int digit = sample - base * next;
-		reversedDigits = reversedDigits * base + digit;
-		invBaseN *= invBase;
-		sample = next;
+		const int n = samples[pixel_idx];
+		if (n < 2)
+			return std::numeric_limits<float>::infinity();
+
+		const float mean     = luminance(beauty[pixel_idx]) / n;
+		const float variance = std::max(0.0f, beauty_lum2[pixel_idx] / n - mean * mean) * n / (n - 1);
+
+		// Offset the denominator so that near-black pixels don't need an absurd number of samples
+		return std::sqrt(variance / n) / (mean + 1e-2f);
 	}
 
-	return std::min(reversedDigits * invBaseN, DoubleOneMinusEpsilon);
-}
+	// Per-pixel means of the AOVs, zero for pixels without samples
+	vec3f normalMean(const int pixel_idx) const noexcept
+	{
+		if (!normal_half.empty()) return halfToVec3f(normal_half[pixel_idx]);
+		return (samples[pixel_idx] > 0) ? normal[pixel_idx] * (1.0f / samples[pixel_idx]) : vec3f(0);
+	}
 
+	vec3f albedoMean(const int pixel_idx) const noexcept
+	{
+		if (!albedo_half.empty()) return halfToVec3f(albedo_half[pixel_idx]);
+		return (samples[pixel_idx] > 0) ? albedo[pixel_idx] * (1.0f / samples[pixel_idx]) : vec3f(0);
+	}
 
-inline real uintToUnitReal(uint32_t v)
-{
-#if USE_DOUBLE
-	constexpr double uint32_double_scale = 1.0 / (1ull << 32);
-	return v * uint32_double_scale;
-#else
-	// Trick from MTGP: generate an uniformly distributed single precision number in [1,2) and subtract 1
-	union
+	float depthMean(const int pixel_idx) const noexcept
 	{
-		uint32_t u;
-		float f;
-	} x;
-	x.u = (v >> 9) | 0x3f800000u;
-	return x.f - 1.0f;
-#endif
-}
+		if (!depth_half.empty()) return halfToFloat(depth_half[pixel_idx]);
+		return (samples[pixel_idx] > 0) ? depth[pixel_idx] * (1.0f / samples[pixel_idx]) : 0.0f;
+	}
 
+	// Accumulate one sample of a pixel
+	void addSample(const int pixel_idx, const vec3f & beauty_, const vec3f & normal_, const vec3f & albedo_, const float depth_) noexcept
+	{
+		beauty[pixel_idx] += beauty_;
+		const int n = ++samples[pixel_idx];
+		if (!beauty_lum2.empty()) beauty_lum2[pixel_idx] += sqr(luminance(beauty_));
 
-inline real wrap1r(real u, real v) { return (u + v < 1) ? u + v : u + v - 1; }
+		if (aovs & aov_half)
+		{
+			// Update the running means, the first sample replaces the cleared value
+			const float w = 1.0f / n;
+			if (!normal_half.empty()) normal_half[pixel_idx] = vec3fToHalf(lerp(halfToVec3f(normal_half[pixel_idx]), normal_, w));
+			if (!albedo_half.empty()) albedo_half[pixel_idx] = vec3fToHalf(lerp(halfToVec3f(albedo_half[pixel_idx]), albedo_, w));
+			if (!depth_half.empty())
+			{
+				const float mean = halfToFloat(depth_half[pixel_idx]);
+				depth_half[pixel_idx] = floatToHalf(mean + (depth_ - mean) * w);
+			}
+		}
+		else
+		{
+			if (!normal.empty()) normal[pixel_idx] += normal_;
+			if (!albedo.empty()) albedo[pixel_idx] += albedo_;
+			if (!depth.empty())  depth[pixel_idx]  += depth_;
+		}
+	}
 
-inline int wrap6i(int & v)
+	double averageSamples() const noexcept
+	{
+		int64_t total = 0;
+		for (const int s : samples)
+			total += s;
+		return total / (double)(xres * yres);
+	}
+
+private:
+	static vec3f halfToVec3f(const std::array<uint16_t, 3> & h) noexcept { return { halfToFloat(h[0]), halfToFloat(h[1]), halfToFloat(h[2]) }; }
+	static std::array<uint16_t, 3> vec3fToHalf(const vec3f & v) noexcept { return { floatToHalf(v.x()), floatToHalf(v.y()), floatToHalf(v.z()) }; }
+	static vec3f lerp(const vec3f & a, const vec3f & b, const float t) noexcept { return a + (b - a) * t; }
+};
+
+
+// Per-pixel convergence state for adaptive sampling, updated between rounds of passes.
+// Converged pixels stop receiving samples, and buckets are handed out in order of decreasing error.
+struct AdaptiveSampling
 {
-	const int o = v;
-	const int u = o + 1;
-	v = (u < 6) ? u : 0;
-	return o;
-}
+	const float error_threshold; // Relative standard error below which a pixel is considered converged
+	const int   min_samples = 16; // Don't trust the variance estimate with fewer samples than this
 
-inline real signum(real v) { return (v >= 0) ? (real)1 : (v == 0 ? 0 : -1); }
+	std::vector<uint8_t> converged; // Per pixel flag in the output's pixel order, once set it stays set
+	std::vector<int> active_buckets; // Buckets with unconverged pixels, sorted by decreasing error
 
-// Convert uniform distribution into triangle-shaped distribution
-// From https://www.shadertoy.com/view/4t2SDh
-inline real triDist(real v)
+
+	AdaptiveSampling(const float error_threshold_, const RenderOutput & output) : error_threshold(error_threshold_)
+	{
+		converged.resize((size_t)output.xres * output.yres);
+		reset(output);
+	}
+
+	void reset(const RenderOutput & output)
+	{
+		if (!converged.empty())
+			memset((void *)&converged[0], 0, converged.size());
+
+		const int num_buckets = numBuckets(output.xres) * numBuckets(output.yres);
+		active_buckets.resize(num_buckets);
+		for (int b = 0; b < num_buckets; ++b)
+			active_buckets[b] = b;
+	}
+
+	// Mark converged pixels and rebuild the list of active buckets, returns the fraction of pixels still active
+	float update(const RenderOutput & output)
+	{
+		const int xres = output.xres;
+		const int yres = output.yres;
+		const int x_buckets = numBuckets(xres);
+		const int num_buckets = x_buckets * numBuckets(yres);
+
+		std::vector<float> bucket_error(num_buckets);
+		std::vector<int>   bucket_active_pixels(num_buckets);
+
+		#pragma omp parallel for
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			const int bucket_y = b / x_buckets;
+			const int bucket_x = b - x_buckets * bucket_y;
+			const int bucket_x0 = bucket_x * bucket_size, bucket_x1 = std::min(bucket_x0 + bucket_size, xres);
+			const int bucket_y0 = bucket_y * bucket_size, bucket_y1 = std::min(bucket_y0 + bucket_size, yres);
+
+			float max_error = 0;
+			int active_pixels = 0;
+			for (int y = bucket_y0; y < bucket_y1; ++y)
+			for (int x = bucket_x0; x < bucket_x1; ++x)
+			{
+				const int pixel_idx = output.pixelIndex(x, y);
+				if (converged[pixel_idx])
+					continue;
+
+				const float error = output.relativeError(pixel_idx);
+				if (output.samples[pixel_idx] >= min_samples && error < error_threshold)
+					converged[pixel_idx] = 1;
+				else
+				{
+					max_error = std::max(max_error, error);
+					active_pixels++;
+				}
+			}
+
+			bucket_error[b] = max_error;
+			bucket_active_pixels[b] = active_pixels;
+		}
+
+		active_buckets.clear();
+		int total_active_pixels = 0;
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			if (bucket_active_pixels[b] > 0)
+				active_buckets.push_back(b);
+			total_active_pixels += bucket_active_pixels[b];
+		}
+		std::stable_sort(active_buckets.begin(), active_buckets.end(), [&](int a, int b) { return bucket_error[a] > bucket_error[b]; });
+
+		return total_active_pixels / (float)(xres * yres);
+	}
+};
+
+
+enum SamplerType { sampler_radical_inverse, sampler_sobol };
+
+enum IntegratorType { integrator_path, integrator_direct, integrator_ao, integrator_aov };
+
+struct RenderSettings
 {
-	const real orig = v * 2 - 1;
-	v = orig / std::sqrt(std::fabs(orig));
-	v = std::max((real)-1, v); // Nerf the NaN generated by 0*rsqrt(0). Thanks @FioraAeterna!
-	v = v - signum(orig);
+	SamplerType sampler = sampler_sobol;
+	IntegratorType integrator = integrator_path;
+	bool adjoint_rr = false; // Roulette and split paths by their expected contribution to the pixel, instead of by albedo
+	int sh_ambient_vertex = 0; // From this path vertex on (1 is the camera hit), diffuse surfaces end the path with unshadowed
+	                           //  environment light from the irradiance SH, zero to always sample the environment
+};
 
-	return v;
-}
 
-// From Alex Evans
-inline vec2r CauchyDist(const vec2r & u)
+// Solid angle pdf of a diffuse bounce, which samples a mixture of the guiding distribution (if any) and the cosine lobe
+inline real diffusePdf(const vec3r & normal, const DirectionalQuadtree * const guide, const real guide_fraction, const vec3r & dir) noexcept
 {
-	const vec2r h = u * vec2r(pi * 2, pi * 0.5f);
-	return vec2r(cos(h.x()), sin(h.x())) * tan(h.y());
+	const real cos_pdf = std::max((real)0, dot(normal, dir)) * (1 / pi);
+	if (guide == nullptr)
+		return cos_pdf;
+	if (cos_pdf <= 0)
+		return 0;
+
+	// Guided directions below the surface are mirrored above it, so both contribute to the pdf
+	const vec3r mirrored = dir - normal * (2 * dot(normal, dir));
+	const real guide_pdf =
+		guide->pdf(vec3f((float)dir.x(), (float)dir.y(), (float)dir.z())) +
+		guide->pdf(vec3f((float)mirrored.x(), (float)mirrored.y(), (float)mirrored.z()));
+	return guide_fraction * guide_pdf + (1 - guide_fraction) * cos_pdf;
 }
 
 
-struct RenderOutput
+using Clock = std::chrono::steady_clock;
+
+struct ThreadControl
 {
-	const int xres, yres;
-	int passes = 0;
+	const int num_passes;
+	const int num_threads;
+	const Clock::time_point deadline = Clock::time_point::max(); // Workers stop taking and finishing buckets after this
+	const AdaptiveSampling * const adaptive = nullptr; // If set, only unconverged pixels are rendered
 
-	std::vector<vec3f> beauty;
-	std::vector<vec3f> normal;
-	std::vector<vec3f> albedo;
+	std::atomic<int> next_bucket = 0;
+	std::atomic<bool> cancelled = false;
 
+	// Passes finished per bucket of the output. Each bucket's passes are rendered one at a time and in order, since they
+	//  accumulate into the same pixels, so that no samples are lost and the sums don't depend on the timing of the threads.
+	std::unique_ptr<std::atomic<int>[]> bucket_passes;
 
-	RenderOutput(int xres_, int yres_) : xres(xres_), yres(yres_)
+	ThreadControl(const int num_passes_, const int num_threads_, const Clock::time_point deadline_, const AdaptiveSampling * const adaptive_, const int num_buckets) :
+		num_passes(num_passes_), num_threads(num_threads_), deadline(deadline_), adaptive(adaptive_), bucket_passes(new std::atomic<int>[num_buckets])
 	{
-		beauty.resize(xres * yres);
-		normal.resize(xres * yres);
-		albedo.resize(xres * yres);
+		for (int i = 0; i < num_buckets; ++i)
+			bucket_passes[i] = 0;
 	}
 
-	void clear()
+	bool checkDeadline() noexcept
 	{
-		passes = 0;
-		memset((void *)&beauty[0], 0, sizeof(vec3f) * xres * yres);
-		memset((void *)&normal[0], 0, sizeof(vec3f) * xres * yres);
-		memset((void *)&albedo[0], 0, sizeof(vec3f) * xres * yres);
+		if (cancelled) return true;
+		if (deadline != Clock::time_point::max() && Clock::now() >= deadline)
+			cancelled = true;
+		return cancelled;
 	}
 };
 
 
-struct ThreadControl
+// Features that are fixed for a whole render, as template parameters so that the integrators only contain the code they use
+template <bool DepthOfField, bool MotionBlur, bool Environment>
+struct RenderFeatures
 {
-	const int num_passes;
+	static constexpr bool depth_of_field = DepthOfField;
+	static constexpr bool motion_blur    = MotionBlur;  // Jitter the camera time over the shutter interval
+	static constexpr bool environment    = Environment; // Light with the HDR environment instead of the gradient sky
+};
 
-	std::atomic<int> next_bucket = 0;
+
+// Everything an integrator needs to render a pixel besides its coordinates, shared by all pixels of a thread
+struct RenderContext
+{
+	Scene & scene;
+	RenderOutput & output;
+	const HDREnvironment * const hdr_env;
+	const RenderSettings & settings;
+	const PathGuiding * const guiding;
+	std::vector<GuidingRecord> * const guiding_records;
+	RadianceCache * const radiance_cache;
+	const StartDistanceGrid * const start_distances; // From the coarser levels of a multi-resolution render, if any
 };
 
 
-inline void render(const int x, const int y, const int frame, const int pass, const int frames, Scene & scene, RenderOutput & output, const HDREnvironment * hdr_env) noexcept
+// Intersect the camera ray of pixel (x, y), skipping the empty space in front of it if we know how much there is
+inline std::pair<SceneObject *, real> cameraIntersection(const RenderContext & ctx, const int x, const int y, const Ray & ray) noexcept
+{
+	if (ctx.start_distances == nullptr)
+		return ctx.scene.nearestIntersection(ray);
+	return ctx.scene.nearestIntersection(ray, ctx.start_distances->get(ctx.output.x0 + x, ctx.output.y0 + y));
+}
+
+
+inline vec3f gradientSky(const vec3r & dir) noexcept
+{
+	const vec3f sky_up  = vec3f{  53, 112, 128 } * (1.0f / 255) * 0.75f;
+	const vec3f sky_hz  = vec3f{ 182, 175, 157 } * (1.0f / 255) * 0.8f;
+	const float height  = 1 - std::max(0.0f, (float)dir.y());
+	const float height2 = height * height;
+	return sky_up + (sky_hz - sky_up) * height2 * height2;
+}
+
+// Sky colour seen directly from the camera
+template <typename Features>
+inline vec3f background(const HDREnvironment * const hdr_env, const vec3r & dir) noexcept
+{
+	if constexpr (Features::environment)
+		return hdr_env->sample(dir);
+	else
+		return gradientSky(dir);
+}
+
+
+// Resolve base albedo and emission from colouring function or material
+inline void surfaceMaterial(const Material & mat, vec3f & albedo, vec3f & emission) noexcept
 {
-	constexpr int max_bounces = 8;
-	constexpr int num_primes  = 6;
-	constexpr static int primes[num_primes] = { 2, 3, 5, 7, 11, 13 };
-	const int xres = output.xres;
-	const int yres = output.yres;
-	const int pixel_idx = y * xres + x;
-
-	const real aspect_ratio = xres / (real)yres;
-	const real fov_deg = 80.f;
-	const real fov_rad = fov_deg * two_pi / 360; // Convert from degrees to radians
-	const real sensor_width  = 2 * std::tan(fov_rad / 2);
-	const real sensor_height = sensor_width / aspect_ratio;
-
-	int dim = 0;
-	const real  hash_random   = noise_data[(y % noise_size) * noise_size + (x % noise_size)] * (1.0f / 65536);
-	const vec2r pixel_u =
+	if (mat.colouring != nullptr)
 	{
-		wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random),
-		wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random)
-	};
-#if 1
-	const vec2r pixel_offset(
-		triDist(pixel_u.x()),
-		triDist(pixel_u.y()));
-#else
-	const vec2r pixel_offset = CauchyDist(pixel_u);
-#endif
-
-	const real shutter = 0.1f; // 1.0f;
-	const real time  = (frames <= 0) ? 0 : two_pi * (frame + shutter * triDist(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random))) / frames;
-	const real cos_t = std::cos(time);
-	const real sin_t = std::sin(time);
-
-#if 1
-	const vec3r cam_lookat = { 0, -0.125f, 0 };
-	const vec3r   world_up = { 0, 1, 0 };
-	const vec3r cam_pos = vec3r{ 4 * cos_t + 10 * sin_t, 5, -10 * cos_t + 4 * sin_t } * 0.25f;
-#else
-	const vec3r cam_lookat = { -1.76, 0, -0.025 };
-	const vec3r   world_up = { 0, 0, -1 };
-	const vec3r cam_pos = cam_lookat + vec3r{ cos_t - sin_t, -7 * cos_t, 4 * cos_t + 7 * sin_t } * 0.02;
-#endif
-	const vec3r cam_forward = normalise(cam_lookat - cam_pos);
-	const vec3r cam_right = normalise(cross(world_up, cam_forward));
-	const vec3r cam_up = normalise(cross(cam_forward, cam_right));
-
-	const vec3r pixel_x = cam_right * (sensor_width  / xres);
-	const vec3r pixel_y = cam_up   * -(sensor_height / yres);
-	const vec3r pixel_v = cam_forward +
-		(pixel_x * (x - xres * 0.5f + pixel_offset.x() + 0.5f)) +
-		(pixel_y * (y - yres * 0.5f + pixel_offset.y() + 0.5f));
-
-	vec3r ray_p = cam_pos;
-	vec3r ray_d = normalise(pixel_v);
-#if 1 // Depth of field
-	const real focal_dist = length(cam_pos - cam_lookat) * 0.65f;
-	const real dof = 0.1f; // 1.0f;
-	const real lens_radius = 0.005f * dof;
-
-	// Random point on disc
-	const real lens_r = std::sqrt(wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random)) * lens_radius;
-	const real lens_a = two_pi *  wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-	const vec3r focal_point = ray_p + ray_d * (focal_dist / dot(ray_d, cam_forward));
-
-	ray_p += cam_right * (std::cos(lens_a) * lens_r) + cam_up * (std::sin(lens_a) * lens_r);
-	ray_d = normalise(focal_point - ray_p);
-#endif
-
-	// Useful for debugging
-	//if (x == xres/2 && y == yres/2)
-	//	int a = 9;
-
-	vec3f
-		contribution = 0,
-		throughput   = 1,
-		normal_out   = 0,
-		albedo_out   = 0;
-
-	Ray    ray = { ray_p, ray_d };
-	int bounce = 0;
-	while (true)
+		mat.colouring->getMaterial(albedo, emission);
+	}
+	else
 	{
-		// Do intersection test
-		const auto [nearest_hit_obj, nearest_hit_t] = scene.nearestIntersection(ray);
+		albedo = mat.albedo;
+		emission = mat.emission;
+	}
+}
+
 
-		// Did we hit anything? If not, return skylight colour
-		if (nearest_hit_obj == nullptr)
+// Direct lighting from a fixed point light, reflected by a Lambertian surface with the given albedo
+inline vec3f pointLight(Scene & scene, const vec3r & hit_p, const vec3r & normal, const vec3f & albedo) noexcept
+{
+	// Compute vector from intersection point to light
+	const vec3r light_pos = { 8, 12, -6 };
+	const vec3r light_vec = light_pos - hit_p;
+
+	// Compute reflected light (simple diffuse / Lambertian) with 1/distance^2 falloff
+	const real n_dot_l = dot(normal, light_vec);
+	if (n_dot_l <= 0)
+		return 0;
+
+	const real  light_ln2 = dot(light_vec, light_vec);
+	const real  light_len = std::sqrt(light_ln2);
+	const vec3r light_dir = light_vec * (1 / light_len);
+
+	// Trace shadow ray from the hit point towards the light
+	const Ray shadow_ray = { hit_p, light_dir };
+	const auto [shadow_nearest_hit_obj, shadow_nearest_hit_t] = scene.nearestIntersection(shadow_ray);
+
+	// If we didn't hit anything (null hit obj or length >= length from hit point to light), the light is visible
+	if (shadow_nearest_hit_obj != nullptr && shadow_nearest_hit_t < light_len)
+		return 0;
+
+	return albedo * (float)n_dot_l / (float)(light_ln2 * light_len) * 720; // 420;
+}
+
+
+// Next event estimation at a diffuse surface for the point light, the environment (if sample_env) and one emissive object.
+// Area and environment light samples are weighted against BSDF sampling, with bsdf_pdf(dir) giving its solid angle pdf.
+template <typename Features, typename Sampler, typename BsdfPdf>
+inline vec3f directLighting(const RenderContext & ctx, Sampler & sampler, const vec3r & hit_p, const vec3r & normal, const vec3f & albedo,
+	const bool sample_env, const BsdfPdf & bsdf_pdf) noexcept
+{
+	Scene & scene = ctx.scene;
+	vec3f direct = pointLight(scene, hit_p, normal, albedo);
+
+	// Next event estimation for the environment map, importance sampled by luminance
+	if constexpr (Features::environment)
+	if (sample_env)
+	{
+		const HDREnvironment * const hdr_env = ctx.hdr_env;
+		vec3r env_dir;
+		const real env_pdf = hdr_env->sampleDirection(sampler.next2(), env_dir);
+		const real cos_l = (env_pdf > 0) ? dot(normal, env_dir) : 0;
+		if (cos_l > 0)
 		{
-			vec3f sky;
-			if (hdr_env && hdr_env->isLoaded())
+			const Ray shadow_ray = { hit_p, env_dir };
+			const auto [shadow_nearest_hit_obj, shadow_nearest_hit_t] = scene.nearestIntersection(shadow_ray);
+			(void) shadow_nearest_hit_t;
+
+			if (shadow_nearest_hit_obj == nullptr)
 			{
-				sky = hdr_env->sample(ray.d);
+				const real weight = powerHeuristic(env_pdf, bsdf_pdf(env_dir)) * cos_l * (1 / pi) / env_pdf;
+				direct += albedo * hdr_env->sample(env_dir, hdr_env->rough_lod) * (float)weight;
 			}
-			else
+		}
+	}
+
+	// Next event estimation for emissive objects: pick a light uniformly and sample its solid angle
+	const int num_lights = (int)scene.lights.size();
+	if (num_lights > 0)
+	{
+		const real  light_select = sampler.next();
+		const vec2r light_u = sampler.next2();
+		SceneObject * const light = scene.lights[std::min((int)(light_select * num_lights), num_lights - 1)];
+
+		vec3r light_dir;
+		const real light_pdf = light->sampleDirection(hit_p, light_u, light_dir) / num_lights;
+		const real cos_l = (light_pdf > 0) ? dot(normal, light_dir) : 0;
+		if (cos_l > 0)
+		{
+			const Ray shadow_ray = { hit_p, light_dir };
+			const auto [shadow_nearest_hit_obj, shadow_nearest_hit_t] = scene.nearestIntersection(shadow_ray);
+			(void) shadow_nearest_hit_t;
+
+			// Lambertian BRDF is albedo / pi, the BSDF sampling pdf for this direction is cos / pi
+			if (shadow_nearest_hit_obj == light)
 			{
-				const vec3f sky_up  = vec3f{  53, 112, 128 } * (1.0f / 255) * 0.75f;
-				const vec3f sky_hz  = vec3f{ 182, 175, 157 } * (1.0f / 255) * 0.8f;
-				const float height  = 1 - std::max(0.0f, (float)ray.d.y());
-				const float height2 = height * height;
-				sky = sky_up + (sky_hz - sky_up) * height2 * height2;
+				const real weight = powerHeuristic(light_pdf, bsdf_pdf(light_dir)) * cos_l * (1 / pi) / light_pdf;
+				direct += albedo * light->mat.emission * (float)weight;
 			}
-			contribution += throughput * sky;
-			break;
 		}
+	}
 
-		// Compute intersection position using returned nearest ray distance
-		const vec3r hit_p = ray.o + ray.d * nearest_hit_t;
+	return direct;
+}
 
-		// Get the normal at the intersction point from the surface we hit
-		const vec3r normal = nearest_hit_obj->getNormal(hit_p);
 
-		const Material & mat = nearest_hit_obj->mat;
+// Integrators render one sample of a pixel into the output buffers, continuing with the sampler that generated the camera ray:
+//     template <typename Features, typename Sampler> static void render(const RenderContext & ctx, int x, int y, Sampler & sampler, const Ray & camera_ray)
+//  They're instantiated for every sampler and feature set by the bucket dispatch below.
 
-		// Resolve base albedo and emission from colouring function or material
-		vec3f base_albedo, base_emission;
-		if (mat.colouring != nullptr)
-		{
-			mat.colouring->getMaterial(base_albedo, base_emission);
-		}
-		else
+// Unidirectional path tracer with next event estimation and MIS, optionally with path guiding, the radiance cache and weight windows
+struct PathIntegrator
+{
+	template <typename Features, typename Sampler>
+	static void render(const RenderContext & ctx, const int x, const int y, Sampler & sampler, const Ray & camera_ray) noexcept
+	{
+		constexpr int max_bounces = 8;
+		Scene & scene = ctx.scene;
+		RenderOutput & output = ctx.output;
+		const HDREnvironment * const hdr_env = ctx.hdr_env;
+		const RenderSettings & settings = ctx.settings;
+		const PathGuiding * const guiding = ctx.guiding;
+		std::vector<GuidingRecord> * const guiding_records = ctx.guiding_records;
+		RadianceCache * const radiance_cache = ctx.radiance_cache;
+		const int pixel_idx = output.pixelIndex(x, y);
+
+		// Useful for debugging
+		//if (x == xres/2 && y == yres/2)
+		//	int a = 9;
+
+		vec3f
+			contribution = 0,
+			throughput   = 1,
+			normal_out   = 0,
+			albedo_out   = 0;
+		float depth_out  = 0;
+
+		Ray    ray = camera_ray;
+		int bounce = 0;
+		real prev_bsdf_pdf = 0; // Solid angle pdf of the last diffuse bounce, zero for camera rays and specular bounces
+		const int num_lights = (int)scene.lights.size();
+
+		// Diffuse vertices of the current branch and its ancestors, for path guiding and the radiance cache.
+		// Their incident radiance is known once the branch terminates.
+		struct RecordedVertex { vec3f position, direction; vec3r normal; float pdf, cos_theta; vec3f throughput, contribution; };
+		RecordedVertex recorded_vertices[max_bounces + 1];
+		int num_recorded_vertices = 0;
+
+		// Vertices where the path was split, with the number of branches still to trace from each
+		struct SplitVertex { vec3r position, normal; vec3f albedo, throughput; const DirectionalQuadtree * guide; int bounce, remaining, first_recorded_vertex; };
+		SplitVertex split_vertices[max_bounces + 1];
+		int num_split_vertices = 0;
+		int num_branches = 1;
+		constexpr int max_branches = 16; // Total over the path, each split vertex adds up to max_splits - 1
+		constexpr int max_splits = 4;
+		constexpr float window_min = 1.0f / 3, window_max = 5.0f / 3; // Weight window around the pixel estimate, as in the paper
+
+		// The previous passes' estimate of this pixel is the target for the expected contribution of a path
+		const int prev_samples = output.samples[pixel_idx];
+		const float pixel_estimate = (settings.adjoint_rr && prev_samples > 0) ? luminance(output.beauty[pixel_idx]) / prev_samples : 0;
+		float first_albedo = 0; // Luminance of the albedo at the first hit, to turn the pixel estimate into an incident radiance estimate
+
+		// Sample the direction leaving a vertex and update the throughput, returns false if the path ends there
+		const auto scatter = [&](const vec3r & position, const vec3r & normal, const vec3f & albedo, const bool sample_specular, const DirectionalQuadtree * const guide) -> bool
 		{
-			base_albedo = mat.albedo;
-			base_emission = mat.emission;
-		}
+			const real guide_fraction = (guide) ? guiding->sampling_fraction : 0;
 
-		// Output render channels
-		if (bounce == 0)
-		{
-			normal_out = vec3f{ (float)normal.x(), (float)normal.z(), (float)normal.y() } * 0.5f + 0.5f; // Swap Y and Z
-			albedo_out = base_albedo;
-		}
+			vec3r new_dir;
+			if (sample_specular)
+			{
+				new_dir = ray.d - normal * (2 * dot(normal, ray.d));
+			}
+			else if (guide && sampler.next() < guide_fraction)
+			{
+				const vec2r guide_u = sampler.next2();
+				const vec3f guide_dir = guide->sample(vec2f((float)guide_u.x(), (float)guide_u.y()));
+				new_dir = normalise(vec3r(guide_dir.x(), guide_dir.y(), guide_dir.z()));
+				if (dot(normal, new_dir) < 0)
+					new_dir -= normal * (2 * dot(normal, new_dir));
+			}
+			else
+			{
+				const vec2r refl_u = sampler.next2();
+				const real refl_sample_x = refl_u.x();
+				const real refl_sample_y = refl_u.y();
+
+				// Generate uniform point on sphere, see https://mathworld.wolfram.com/SpherePointPicking.html
+				const real a = refl_sample_x * two_pi;
+				const real s = 2 * std::sqrt(std::max(static_cast<real>(0), refl_sample_y * (1 - refl_sample_y)));
+				const vec3r sphere =
+				{
+					std::cos(a) * s,
+					std::sin(a) * s,
+					1 - 2 * refl_sample_y
+				};
+
+				// Generate new cosine-weighted exitant direction
+				new_dir = normalise(normal + sphere);
+			}
+			prev_bsdf_pdf = (sample_specular) ? 0 : diffusePdf(normal, guide, guide_fraction, new_dir);
 
-		// Add emission
-		contribution += throughput * base_emission;
+			// Multiply the throughput by the surface reflection, with the ratio of the cosine lobe to the mixture pdf if guided
+			if (guide)
+			{
+				const real cos_o = dot(normal, new_dir);
+				if (cos_o <= 0 || prev_bsdf_pdf <= 0)
+					return false;
+				throughput *= albedo * (float)(cos_o * (1 / pi) / prev_bsdf_pdf);
+			}
+			else
+				throughput *= albedo;
 
-		// Add some shininess using Schlick Frensel approximation
-		bool sample_specular;
-		vec3f albedo;
-		if (mat.use_fresnel)
-		{
-			const real r0 = mat.r0;
-			const real p1 = 1 - std::fabs(dot(normal, ray.d));
-			const real p2 = p1 * p1;
-			const real fresnel = r0 + (1 - r0) * p2 * p2 * p1;
-
-			const real mat_u = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			sample_specular = mat_u < fresnel;
-			albedo = (sample_specular) ? 0.95f : base_albedo;
-		}
-		else
+			if ((guiding_records || radiance_cache) && !sample_specular)
+			{
+				recorded_vertices[num_recorded_vertices++] =
+				{
+					vec3f((float)position.x(), (float)position.y(), (float)position.z()),
+					vec3f((float)new_dir.x(), (float)new_dir.y(), (float)new_dir.z()),
+					normal, (float)prev_bsdf_pdf, (float)dot(normal, new_dir), throughput, contribution
+				};
+			}
+
+			// Start next bounce from the hit position in the scattered ray direction
+			ray.o = position;
+			ray.d = new_dir;
+			return true;
+		};
+
+		// The radiance arriving along each recorded direction is whatever the path gathered afterwards, divided by the throughput.
+		// For guiding it's weighted by the cosine so the trees learn the whole diffuse integrand, rather than light arriving at
+		//  grazing angles. Records are only complete once all the branches below them have been traced.
+		const auto addRecords = [&](const int first)
 		{
-			sample_specular = false;
-			albedo = base_albedo;
-		}
+			for (int i = first; i < num_recorded_vertices; ++i)
+			{
+				const RecordedVertex & v = recorded_vertices[i];
+				const vec3f incident = contribution - v.contribution;
+				const vec3f radiance =
+				{
+					(v.throughput.x() > 0) ? incident.x() / v.throughput.x() : 0,
+					(v.throughput.y() > 0) ? incident.y() / v.throughput.y() : 0,
+					(v.throughput.z() > 0) ? incident.z() / v.throughput.z() : 0
+				};
+
+				if (guiding_records)
+					guiding_records->push_back({ v.position, v.direction, luminance(radiance) * v.cos_theta, v.pdf });
+
+				// Estimate of the reflected irradiance / pi, which is just the radiance for cosine-weighted directions
+				if (radiance_cache)
+					radiance_cache->deposit(vec3r(v.position.x(), v.position.y(), v.position.z()), v.normal, radiance * (v.cos_theta * (float)(1 / pi) / v.pdf));
+			}
+			num_recorded_vertices = first;
+		};
 
-		// Do direct lighting from a fixed point light
-		if (!sample_specular)
+		while (true)
 		{
-			// Compute vector from intersection point to light
-			const vec3r light_pos = { 8, 12, -6 };
-			const vec3r light_vec = light_pos - hit_p;
+			while (true)
+			{
+				// Do intersection test
+				const auto [nearest_hit_obj, nearest_hit_t] = (bounce == 0) ? cameraIntersection(ctx, x, y, ray) : scene.nearestIntersection(ray);
+
+				// Did we hit anything? If not, return skylight colour
+				if (nearest_hit_obj == nullptr)
+				{
+					vec3f sky;
+					if constexpr (Features::environment)
+					{
+						// Weight against environment sampling if we got here by a diffuse bounce, which can use a blurrier mip
+						if (prev_bsdf_pdf > 0)
+							sky = hdr_env->sample(ray.d, hdr_env->rough_lod) * (float)powerHeuristic(prev_bsdf_pdf, hdr_env->directionPdf(ray.d));
+						else
+							sky = hdr_env->sample(ray.d);
+					}
+					else
+						sky = gradientSky(ray.d);
+					contribution += throughput * sky;
+					break;
+				}
+
+				// Compute intersection position using returned nearest ray distance
+				const vec3r hit_p = ray.o + ray.d * nearest_hit_t;
+
+				// Get the normal at the intersction point from the surface we hit
+				const vec3r normal = nearest_hit_obj->getNormal(hit_p);
+
+				const Material & mat = nearest_hit_obj->mat;
+
+				vec3f base_albedo, base_emission;
+				surfaceMaterial(mat, base_albedo, base_emission);
+
+				// Output render channels
+				if (bounce == 0)
+				{
+					normal_out = encodeNormal(normal);
+					albedo_out = base_albedo;
+					first_albedo = luminance(base_albedo);
+					depth_out  = (float)nearest_hit_t;
+				}
+
+				// Add emission, weighted against the light sampling strategy if this light could have been sampled directly
+				if (prev_bsdf_pdf > 0 && Scene::isLight(nearest_hit_obj))
+				{
+					const real light_pdf = nearest_hit_obj->directionPdf(ray.o, ray.d) / num_lights;
+					contribution += throughput * base_emission * (float)powerHeuristic(prev_bsdf_pdf, light_pdf);
+				}
+				else
+					contribution += throughput * base_emission;
+
+				// Add some shininess using Schlick Frensel approximation
+				bool sample_specular;
+				vec3f albedo;
+				if (mat.use_fresnel)
+				{
+					const real r0 = mat.r0;
+					const real p1 = 1 - std::fabs(dot(normal, ray.d));
+					const real p2 = p1 * p1;
+					const real fresnel = r0 + (1 - r0) * p2 * p2 * p1;
+
+					const real mat_u = sampler.next();
+					sample_specular = mat_u < fresnel;
+					albedo = (sample_specular) ? 0.95f : base_albedo;
+				}
+				else
+				{
+					sample_specular = false;
+					albedo = base_albedo;
+				}
+
+				// With path guiding, diffuse bounces sample a mixture of the learned incident radiance and the cosine lobe
+				const DirectionalQuadtree * const guide = (guiding && !sample_specular) ? guiding->samplingTree(hit_p) : nullptr;
+				const float guide_fraction = (guide) ? guiding->sampling_fraction : 0.0f;
+				const auto diffuse_pdf = [&](const vec3r & dir) { return diffusePdf(normal, guide, guide_fraction, dir); };
+
+				// Far enough along the path, replace environment sampling and any further bounces with the SH ambient term
+				const bool sh_ambient = Features::environment && !sample_specular && settings.sh_ambient_vertex > 0 && bounce + 1 >= settings.sh_ambient_vertex;
+
+				// Where the path ends no BSDF sample can find the lights, so light sampling has to carry all of their light
+				const bool last_vertex = sh_ambient || bounce + 1 > max_bounces;
+				const auto nee_bsdf_pdf = [&](const vec3r & dir) { return (last_vertex) ? (real)0 : diffuse_pdf(dir); };
+
+				if (!sample_specular)
+					contribution += throughput * directLighting<Features>(ctx, sampler, hit_p, normal, albedo, !sh_ambient, nee_bsdf_pdf);
+
+				if (sh_ambient)
+				{
+					contribution += throughput * albedo * hdr_env->irradiance(normal) * (float)(1 / pi);
+					break;
+				}
+
+				if (++bounce > max_bounces)
+					break;
+
+				// Stop in the radiance cache if it has an estimate here, which includes all further bounces
+				vec3f cached_radiance;
+				if (radiance_cache && !sample_specular && bounce >= radiance_cache->min_bounce && radiance_cache->lookup(hit_p, normal, cached_radiance))
+				{
+					contribution += throughput * albedo * cached_radiance;
+					break;
+				}
+
+				// Terminate the path unconditionally if the albedo is super low or zero
+				const float max_albedo = std::max(std::max(albedo.x(), albedo.y()), albedo.z());
+				if (max_albedo < 1e-8f)
+					break;
+
+				if (pixel_estimate > 0)
+				{
+					// Weight window (Vorba and Krivanek 2016): paths expected to contribute much less than the pixel's value are rouletted,
+					//  and paths expected to contribute much more are split. The local incident radiance comes from the guiding cache when
+					//  available, otherwise from the pixel estimate assuming each vertex receives about as much light as the first.
+					const float irradiance = (guide) ? guiding->irradiance(hit_p) : 0;
+					const float incident = (irradiance > 0) ? irradiance * (float)(1 / pi) : pixel_estimate / std::max(first_albedo, 1e-3f);
+					const float ratio = luminance(throughput * albedo) * incident / pixel_estimate;
+					if (ratio < window_min)
+					{
+						// Never go below a small survival probability, in case the estimate is badly off
+						const float survival = std::max(ratio / window_min, 0.05f);
+						if ((float)sampler.next() > survival)
+							break;
+						throughput *= (1.0f / survival);
+					}
+					else if (ratio > window_max && !sample_specular && num_branches < max_branches)
+					{
+						const int num_splits = std::min(std::min((int)(ratio + 0.5f), max_splits), max_branches - num_branches + 1);
+						throughput *= (1.0f / num_splits);
+						split_vertices[num_split_vertices++] = { hit_p, normal, albedo, throughput, guide, bounce, num_splits - 1, num_recorded_vertices };
+						num_branches += num_splits - 1;
+					}
+				}
+				else if (bounce > 3)
+				{
+					// Use Russian roulette on albedo to possibly terminate the path after 2 bounces
+					const float rr_u = (float)sampler.next();
+					const float rr_thresh = std::max(0.0f, std::min(1.0f, max_albedo));
+					if (rr_u > rr_thresh)
+						break;
+					throughput *= (1.0f / rr_thresh);
+				}
+
+				if (!scatter(hit_p, normal, albedo, sample_specular, guide))
+					break;
+			}
 
-			// Compute reflected light (simple diffuse / Lambertian) with 1/distance^2 falloff
-			const real n_dot_l = dot(normal, light_vec);
-			if (n_dot_l > 0)
+			// The branch has ended, continue with the next branch from the innermost split vertex that has any left
+			bool resumed = false;
+			while (!resumed)
 			{
-				const real  light_ln2 = dot(light_vec, light_vec);
-				const real  light_len = std::sqrt(light_ln2);
-				const vec3r light_dir = light_vec * (1 / light_len);
+				addRecords((num_split_vertices > 0) ? split_vertices[num_split_vertices - 1].first_recorded_vertex : 0);
+				if (num_split_vertices == 0)
+					break;
+
+				SplitVertex & v = split_vertices[num_split_vertices - 1];
+				if (v.remaining == 0)
+				{
+					num_split_vertices--;
+					continue;
+				}
+				v.remaining--;
+				throughput = v.throughput;
+				bounce = v.bounce;
+				resumed = scatter(v.position, v.normal, v.albedo, false, v.guide);
+			}
+			if (!resumed)
+				break;
+		}
+
+		output.addSample(pixel_idx, contribution, normal_out, albedo_out, depth_out);
+	}
+};
 
-				const vec3f refl_colour = albedo * (float)n_dot_l / (float)(light_ln2 * light_len) * 720; // 420;
 
-				// Trace shadow ray from the hit point towards the light
-				const Ray shadow_ray = { hit_p, light_dir };
-				const auto [shadow_nearest_hit_obj, shadow_nearest_hit_t] = scene.nearestIntersection(shadow_ray);
+// Direct lighting only: emission and next event estimation at the camera hit, without any bounces
+struct DirectIntegrator
+{
+	template <typename Features, typename Sampler>
+	static void render(const RenderContext & ctx, const int x, const int y, Sampler & sampler, const Ray & camera_ray) noexcept
+	{
+		RenderOutput & output = ctx.output;
+		const int pixel_idx = output.pixelIndex(x, y);
+		const Ray & ray = camera_ray;
 
-				// If we didn't hit anything (null hit obj or length >= length from hit point to light),
-				//  add the directly reflected light to the path contribution
-				if (shadow_nearest_hit_obj == nullptr || shadow_nearest_hit_t >= light_len)
-					contribution += throughput * refl_colour;
-			}
+		const auto [hit_obj, hit_t] = cameraIntersection(ctx, x, y, ray);
+		if (hit_obj == nullptr)
+		{
+			output.addSample(pixel_idx, background<Features>(ctx.hdr_env, ray.d), 0, 0, 0);
+			return;
 		}
 
-		if (++bounce > max_bounces)
-			break;
+		const vec3r hit_p  = ray.o + ray.d * hit_t;
+		const vec3r normal = hit_obj->getNormal(hit_p);
 
-		// Terminate the path unconditionally if the albedo is super low or zero
-		const float max_albedo = std::max(std::max(albedo.x(), albedo.y()), albedo.z());
-		if (max_albedo < 1e-8f)
-			break;
+		vec3f albedo, emission;
+		surfaceMaterial(hit_obj->mat, albedo, emission);
 
-		// Use Russian roulette on albedo to possibly terminate the path after 2 bounces
-		if (bounce > 3)
+		// Without BSDF sampling the light samples get the full weight
+		const vec3f contribution = emission + directLighting<Features>(ctx, sampler, hit_p, normal, albedo, true, [](const vec3r &) { return (real)0; });
+		output.addSample(pixel_idx, contribution, encodeNormal(normal), albedo, (float)hit_t);
+	}
+};
+
+
+// Fast preview integrator: primary hit, ambient occlusion from distance estimates along the normal, and one shadow ray.
+// Ref: "Rendering Worlds with Two Triangles", Quilez 2008
+struct AOIntegrator
+{
+	template <typename Features, typename Sampler>
+	static void render(const RenderContext & ctx, const int x, const int y, Sampler &, const Ray & camera_ray) noexcept
+	{
+		constexpr int   num_ao_taps = 3; // Each tap is a full DE evaluation, which is most of the cost for formulas that don't bail out
+		constexpr float ao_distance = 0.1f; // Height of the last tap above the surface
+		Scene & scene = ctx.scene;
+		RenderOutput & output = ctx.output;
+		const int pixel_idx = output.pixelIndex(x, y);
+		const Ray & ray = camera_ray;
+
+		const auto [hit_obj, hit_t] = cameraIntersection(ctx, x, y, ray);
+		if (hit_obj == nullptr)
 		{
-			const float rr_u = (float)wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			const float rr_thresh = std::max(0.0f, std::min(1.0f, max_albedo));
-			if (rr_u > rr_thresh)
-				break;
-			throughput *= (1.0f / rr_thresh);
+			output.addSample(pixel_idx, background<Features>(ctx.hdr_env, ray.d), 0, 0, 0);
+			return;
 		}
 
-		vec3r new_dir;
-		if (sample_specular)
+		const vec3r hit_p  = ray.o + ray.d * hit_t;
+		const vec3r normal = hit_obj->getNormal(hit_p);
+
+		// Get the material before evaluating any other distance estimates, which would change the colouring function's state
+		vec3f albedo, emission;
+		surfaceMaterial(hit_obj->mat, albedo, emission);
+
+		// Any surface closer than the height of a tap above the surface occludes it, with nearer taps weighted more.
+		// The heights double from tap to tap, so that few taps still cover both creases and larger scale occlusion.
+		float occlusion = 0, weight = 1, weight_sum = 0, h = ao_distance;
+		for (int i = 1; i < num_ao_taps; ++i)
+			h *= 0.5f;
+		for (int i = 0; i < num_ao_taps; ++i)
 		{
-			new_dir = ray.d - normal * (2 * dot(normal, ray.d));
+			const float dist = (float)scene.getDistance(hit_p + normal * h);
+			occlusion  += weight * std::max(0.0f, std::min(1.0f, (h - dist) / h));
+			weight_sum += weight;
+			weight *= 0.5f;
+			h *= 2;
 		}
+		const float ao = 1 - occlusion / weight_sum;
+
+		// Unshadowed sky light scaled by the occlusion
+		vec3f ambient;
+		if constexpr (Features::environment)
+			ambient = ctx.hdr_env->irradiance(normal) * (float)(1 / pi);
 		else
-		{
-			const real refl_sample_x = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
-			const real refl_sample_y = wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
+			ambient = gradientSky(normal);
+
+		const vec3f contribution = emission + albedo * ambient * ao + pointLight(scene, hit_p, normal, albedo);
+		output.addSample(pixel_idx, contribution, encodeNormal(normal), albedo, (float)hit_t);
+	}
+};
 
-			// Generate uniform point on sphere, see https://mathworld.wolfram.com/SpherePointPicking.html
-			const real a = refl_sample_x * two_pi;
-			const real s = 2 * std::sqrt(std::max(static_cast<real>(0), refl_sample_y * (1 - refl_sample_y)));
-			const vec3r sphere =
-			{
-				std::cos(a) * s,
-				std::sin(a) * s,
-				1 - 2 * refl_sample_y
-			};
 
-			// Generate new cosine-weighted exitant direction
-			new_dir = normalise(normal + sphere);
+// Only the camera hit's normal, albedo and depth, with the albedo as the beauty, for checking geometry and colouring
+struct AOVIntegrator
+{
+	template <typename Features, typename Sampler>
+	static void render(const RenderContext & ctx, const int x, const int y, Sampler &, const Ray & camera_ray) noexcept
+	{
+		RenderOutput & output = ctx.output;
+		const int pixel_idx = output.pixelIndex(x, y);
+		const Ray & ray = camera_ray;
+
+		const auto [hit_obj, hit_t] = cameraIntersection(ctx, x, y, ray);
+		if (hit_obj == nullptr)
+		{
+			output.addSample(pixel_idx, 0, 0, 0, 0);
+			return;
 		}
 
-		// Multiply the throughput by the surface reflection
-		throughput *= albedo;
+		const vec3r normal = hit_obj->getNormal(ray.o + ray.d * hit_t);
 
-		// Start next bounce from the hit position in the scattered ray direction
-		ray.o = hit_p;
-		ray.d = new_dir;
+		vec3f albedo, emission;
+		surfaceMaterial(hit_obj->mat, albedo, emission);
+
+		output.addSample(pixel_idx, albedo, encodeNormal(normal), albedo, (float)hit_t);
 	}
+};
+
 
-	output.beauty[pixel_idx] += contribution;
-	output.normal[pixel_idx] += normal_out;
-	output.albedo[pixel_idx] += albedo_out;
+// Renders one pass over the pixels of a bucket, with the integrator, sampler and features all fixed for the loop
+using BucketFunction = void (*)(const RenderContext & ctx, ThreadControl & thread_control, int x0, int x1, int y0, int y1, int pass) noexcept;
+
+template <typename Integrator, typename Sampler, typename Features>
+void renderBucket(const RenderContext & ctx, ThreadControl & thread_control, const int x0, const int x1, const int y0, const int y1, const int pass) noexcept
+{
+	const AdaptiveSampling * const adaptive = thread_control.adaptive;
+	const Camera & camera = ctx.scene.camera;
+
+	// Check the deadline once per row so that in-flight buckets are cancelled promptly,
+	//  the per-pixel sample counts take care of normalising the partially completed pass
+	for (int y = y0; y < y1 && !thread_control.checkDeadline(); ++y)
+	for (int x = x0; x < x1; ++x)
+		if (!adaptive || !adaptive->converged[ctx.output.pixelIndex(x, y)])
+		{
+			Sampler sampler(ctx.output.x0 + x, ctx.output.y0 + y, pass);
+			const Ray ray = camera.generateRay<Features>(x, y, sampler);
+			Integrator::template render<Features>(ctx, x, y, sampler, ray);
+		}
+}
+
+template <typename Integrator, typename Sampler>
+BucketFunction selectFeatures(const bool depth_of_field, const bool motion_blur, const bool environment) noexcept
+{
+	constexpr BucketFunction functions[8] =
+	{
+		renderBucket<Integrator, Sampler, RenderFeatures<false, false, false>>,
+		renderBucket<Integrator, Sampler, RenderFeatures<false, false, true >>,
+		renderBucket<Integrator, Sampler, RenderFeatures<false, true,  false>>,
+		renderBucket<Integrator, Sampler, RenderFeatures<false, true,  true >>,
+		renderBucket<Integrator, Sampler, RenderFeatures<true,  false, false>>,
+		renderBucket<Integrator, Sampler, RenderFeatures<true,  false, true >>,
+		renderBucket<Integrator, Sampler, RenderFeatures<true,  true,  false>>,
+		renderBucket<Integrator, Sampler, RenderFeatures<true,  true,  true >>
+	};
+	return functions[(depth_of_field ? 4 : 0) + (motion_blur ? 2 : 0) + (environment ? 1 : 0)];
+}
+
+template <typename Integrator>
+BucketFunction selectSampler(const RenderSettings & settings, const bool depth_of_field, const bool motion_blur, const bool environment) noexcept
+{
+	if (settings.sampler == sampler_sobol)
+		return selectFeatures<Integrator, SobolSampler>(depth_of_field, motion_blur, environment);
+	else
+		return selectFeatures<Integrator, RadicalInverseSampler>(depth_of_field, motion_blur, environment);
+}
+
+inline BucketFunction selectIntegrator(const RenderSettings & settings, const bool depth_of_field, const bool motion_blur, const bool environment) noexcept
+{
+	switch (settings.integrator)
+	{
+	case integrator_direct: return selectSampler<DirectIntegrator>(settings, depth_of_field, motion_blur, environment);
+	case integrator_ao:     return selectSampler<AOIntegrator>    (settings, depth_of_field, motion_blur, environment);
+	case integrator_aov:    return selectSampler<AOVIntegrator>   (settings, depth_of_field, motion_blur, environment);
+	default:                return selectSampler<PathIntegrator>  (settings, depth_of_field, motion_blur, environment);
+	}
 }
 
 
 void renderThreadFunction(
 	ThreadControl * const thread_control,
 	RenderOutput * const output,
-	const int frame, const int base_pass, const int frames, const Scene * const scene_,
-	const HDREnvironment * const hdr_env) noexcept
+	const int base_pass, const Scene * const scene_,
+	const HDREnvironment * const hdr_env, const RenderSettings * const settings, PathGuiding * const guiding, RadianceCache * const radiance_cache,
+	const StartDistanceGrid * const start_distances) noexcept
 {
 	const int xres = output->xres;
 	const int yres = output->yres;
@@ -389,30 +998,58 @@ void renderThreadFunction(
 	// Make a local copy of the world for this thread, needed because it will get modified during init
 	Scene scene(*scene_);
 
-	// Get rounded up number of buckets in x and y
-	constexpr int bucket_size = 32;
-	const int x_buckets = (xres + bucket_size - 1) / bucket_size;
-	const int y_buckets = (yres + bucket_size - 1) / bucket_size;
-	const int num_buckets = x_buckets * y_buckets;
+	// With adaptive sampling we only visit the active buckets, in the order given
+	const AdaptiveSampling * const adaptive = thread_control->adaptive;
+	const int x_buckets = numBuckets(xres);
+	const int num_buckets = (adaptive) ? (int)adaptive->active_buckets.size() : x_buckets * numBuckets(yres);
 	const int num_passes = thread_control->num_passes;
 
+	// With fewer buckets than threads, as for small tiles or late in adaptive sampling, the threads would mostly wait for
+	//  each other's passes of the same buckets. Each thread takes whole buckets with all their passes instead.
+	const bool whole_buckets = num_buckets < thread_control->num_threads;
+	const int num_items = (whole_buckets) ? num_buckets : num_buckets * num_passes;
+
+	// Guiding records are buffered per thread and splatted after each pass of a bucket
+	std::vector<GuidingRecord> guiding_records;
+
+	// Pick the specialised bucket loop once
+	const RenderContext ctx = { scene, *output, hdr_env, *settings, guiding, (guiding) ? &guiding_records : nullptr, radiance_cache, start_distances };
+	const BucketFunction render_bucket = selectIntegrator(*settings, scene.camera.depthOfField(), scene.camera.motionBlur(), hdr_env && hdr_env->isLoaded());
+
 	while (true)
 	{
-		// Get the next bucket index atomically and exit if we're done
-		const int bucket = thread_control->next_bucket.fetch_add(1);
-		if (bucket >= num_buckets * num_passes)
+		// Get the next bucket index atomically and exit if we're done or out of time
+		if (thread_control->checkDeadline())
+			break;
+		const int item = thread_control->next_bucket.fetch_add(1);
+		if (item >= num_items)
 			break;
 
-		// Get sub-pass and pixel ranges for current bucket
-		const int sub_pass  = bucket / num_buckets;
-		const int bucket_p  = bucket - num_buckets * sub_pass;
+		// Get sub-passes and pixel ranges for current bucket
+		const int first_pass = (whole_buckets) ? 0 : item / num_buckets;
+		const int  last_pass = (whole_buckets) ? num_passes : first_pass + 1;
+		const int bucket_i  = item - num_buckets * ((whole_buckets) ? 0 : first_pass);
+		const int bucket_p  = (adaptive) ? adaptive->active_buckets[bucket_i] : bucket_i;
 		const int bucket_y  = bucket_p / x_buckets;
 		const int bucket_x  = bucket_p - x_buckets * bucket_y;
 		const int bucket_x0 = bucket_x * bucket_size, bucket_x1 = std::min(bucket_x0 + bucket_size, xres);
 		const int bucket_y0 = bucket_y * bucket_size, bucket_y1 = std::min(bucket_y0 + bucket_size, yres);
 
-		for (int y = bucket_y0; y < bucket_y1; ++y)
-		for (int x = bucket_x0; x < bucket_x1; ++x)
-			render(x, y, frame, base_pass + sub_pass, frames, scene, *output, hdr_env);
+		// If a bucket is slow, another thread can still be rendering the previous pass of it
+		std::atomic<int> & passes_done = thread_control->bucket_passes[bucket_p];
+		while (passes_done.load(std::memory_order_acquire) != first_pass)
+			std::this_thread::yield();
+
+		for (int sub_pass = first_pass; sub_pass < last_pass && !thread_control->checkDeadline(); ++sub_pass)
+		{
+			render_bucket(ctx, *thread_control, bucket_x0, bucket_x1, bucket_y0, bucket_y1, base_pass + sub_pass);
+
+			if (guiding)
+			{
+				guiding->deposit(guiding_records);
+				guiding_records.clear();
+			}
+		}
+		passes_done.store(last_pass, std::memory_order_release);
 	}
 }
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <algorithm>
+
+#include "maths/vec.h"
+
+
+
+constexpr int noise_size = 1 << 8;
+std::array<uint16_t, noise_size * noise_size> noise_data;
+
+
+void HilbertFibonacci(const vec2i dx, const vec2i dy, vec2i p, int size, uint64_t & next_val)
+{
+	if (size > 1)
+	{
+		size >>= 1;
+		HilbertFibonacci( dy,  dx, p, size, next_val); p += dy *  size;
+		HilbertFibonacci( dx,  dy, p, size, next_val); p += dx *  size;
+		HilbertFibonacci( dx,  dy, p, size, next_val); p += dx * (size - 1) - dy;
+		HilbertFibonacci(-dy, -dx, p, size, next_val);
+	}
+	else
+	{
+		next_val += 11400714819323198487ull;
+		noise_data[p.y() * noise_size + p.x()] = (uint16_t)(next_val >> 48);
+	}
+}
+
+// From PBRT
+double RadicalInverse(int sample, int base) noexcept
+{
+	const double invBase = 1.0 / base;
+
+	int reversedDigits = 0;
+	double invBaseN = 1;
+	while (sample)
+	{
+		const int next  = sample / base;
+		const int digit = sample - base * next;
+		reversedDigits = reversedDigits * base + digit;
+		invBaseN *= invBase;
+		sample = next;
+	}
+
+	return std::min(reversedDigits * invBaseN, DoubleOneMinusEpsilon);
+}
+
+
+inline real uintToUnitReal(uint32_t v)
+{
+#if USE_DOUBLE
+	constexpr double uint32_double_scale = 1.0 / (1ull << 32);
+	return v * uint32_double_scale;
+#else
+	// Trick from MTGP: generate an uniformly distributed single precision number in [1,2) and subtract 1
+	union
+	{
+		uint32_t u;
+		float f;
+	} x;
+	x.u = (v >> 9) | 0x3f800000u;
+	return x.f - 1.0f;
+#endif
+}
+
+
+inline real wrap1r(real u, real v) { return (u + v < 1) ? u + v : u + v - 1; }
+
+inline int wrap6i(int & v)
+{
+	const int o = v;
+	const int u = o + 1;
+	v = (u < 6) ? u : 0;
+	return o;
+}
+
+
+// Bit reversal of a 32 bit integer, the compiler should turn this into a handful of instructions
+constexpr uint32_t reverseBits(uint32_t v) noexcept
+{
+	v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+	v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+	v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+	v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+// Integer hash with good avalanche, from https://nullprogram.com/blog/2018/07/31/
+inline uint32_t hashUint(uint32_t v) noexcept
+{
+	v ^= v >> 16; v *= 0x7feb352du;
+	v ^= v >> 15; v *= 0x846ca68bu;
+	v ^= v >> 16;
+	return v;
+}
+
+inline uint32_t hashCombine(uint32_t seed, uint32_t v) noexcept { return seed ^ (v + (seed << 6) + (seed >> 2)); }
+
+
+// The original sampler: radical inverse of the pass index in the first six prime bases,
+//  Cranley-Patterson rotated per pixel by the blue noise value. Dimensions wrap around after six.
+struct RadicalInverseSampler
+{
+	const int pass;
+	const real hash_random;
+	int dim = 0;
+
+
+	RadicalInverseSampler(const int x, const int y, const int pass_) :
+		pass(pass_), hash_random(noise_data[(y % noise_size) * noise_size + (x % noise_size)] * (1.0f / 65536)) { }
+
+	real next() noexcept
+	{
+		constexpr int num_primes = 6;
+		constexpr static int primes[num_primes] = { 2, 3, 5, 7, 11, 13 };
+
+		return wrap1r((real)RadicalInverse(pass, primes[wrap6i(dim)]), hash_random);
+	}
+
+	vec2r next2() noexcept { const real u = next(); return { u, next() }; }
+};
+
+
+// Generator matrices for the first 4 Sobol dimensions, from the Joe-Kuo direction numbers
+constexpr uint32_t sobol_matrices[4][32] =
+{
+	{
+		0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+		0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+		0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+		0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001
+	},
+	{
+		0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+		0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+		0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+		0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+	},
+	{
+		0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+		0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+		0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+		0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+	},
+	{
+		0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+		0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+		0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+		0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+	}
+};
+
+// The generator matrices applied to each possible byte of the index, so that evaluating
+//  a Sobol dimension is 4 table lookups instead of a loop over all 32 (scrambled) index bits.
+// Owen scrambling works on bit-reversed values, so the tables take and return bit-reversed values
+//  to save reversing back and forth.
+using SobolByteTables = std::array<std::array<std::array<uint32_t, 256>, 4>, 4>;
+
+constexpr SobolByteTables makeSobolByteTables() noexcept
+{
+	SobolByteTables t = {};
+	for (int d = 0; d < 4; ++d)
+	for (int b = 0; b < 4; ++b)
+	for (int v = 0; v < 256; ++v)
+	{
+		uint32_t r = 0;
+		for (int bit = 0; bit < 8; ++bit)
+			if (v & (1 << bit))
+				r ^= sobol_matrices[d][31 - (b * 8 + bit)]; // Bit k of the reversed index is bit 31-k of the index
+		t[d][b][v] = reverseBits(r);
+	}
+	return t;
+}
+
+constexpr SobolByteTables sobol_byte_tables = makeSobolByteTables();
+
+
+// Owen-scrambled Sobol sampler, padded to any number of dimensions by independently shuffling
+//  and scrambling consecutive sets of 4 Sobol dimensions. The per-pixel seed comes from the blue noise value.
+// Ref: "Practical Hash-based Owen Scrambling", Brent Burley, JCGT 2020 <https://jcgt.org/published/0009/04/01/>
+struct SobolSampler
+{
+	const uint32_t index_rev; // Bit-reversed sample index
+	const uint32_t pixel_seed;
+	int dim = 0;
+
+	uint32_t set_seed = 0;      // Seed for the current set of 4 dimensions
+	uint32_t set_index_rev = 0; // Shuffled sample index for the current set of 4 dimensions, bit-reversed
+
+
+	SobolSampler(const int x, const int y, const int pass) :
+		index_rev(reverseBits((uint32_t)pass)), pixel_seed(hashUint(noise_data[(y % noise_size) * noise_size + (x % noise_size)])) { }
+
+	// Laine-Karras style hash which only propagates bits upwards, so applied to reversed bits it's an Owen scramble
+	static uint32_t laineKarrasPermutation(uint32_t v, const uint32_t seed) noexcept
+	{
+		v += seed;
+		v ^= v * 0x6c50b47cu;
+		v ^= v * 0xb82f1e52u;
+		v ^= v * 0xc7afe638u;
+		v ^= v * 0x8d22f6e6u;
+		return v;
+	}
+
+	static uint32_t sobolReversed(const uint32_t i_rev, const int d) noexcept
+	{
+		return
+			sobol_byte_tables[d][0][(i_rev >>  0) & 255] ^
+			sobol_byte_tables[d][1][(i_rev >>  8) & 255] ^
+			sobol_byte_tables[d][2][(i_rev >> 16) & 255] ^
+			sobol_byte_tables[d][3][(i_rev >> 24) & 255];
+	}
+
+	real next() noexcept
+	{
+		const int d = dim & 3;
+		if (d == 0)
+		{
+			set_seed = hashCombine(pixel_seed, hashUint((uint32_t)dim));
+			set_index_rev = laineKarrasPermutation(index_rev, set_seed);
+		}
+		dim++;
+
+		const uint32_t v_rev = laineKarrasPermutation(sobolReversed(set_index_rev, d), hashCombine(set_seed, (uint32_t)d));
+		return uintToUnitReal(reverseBits(v_rev));
+	}
+
+	// Keep 2D samples within an aligned pair of Sobol dimensions to get their 2D stratification
+	vec2r next2() noexcept
+	{
+		if (dim & 1) dim++;
+		const real u = next();
+		return { u, next() };
+	}
+};
@@ -1,14 +1,20 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 
 #include "scene_objects/SceneObject.h"
+#include "Camera.h"
+#include "BVH.h"
 
 
 
 struct Scene
 {
 	std::vector<SceneObject *> objects;
+	std::vector<SceneObject *> lights; // Emissive objects which can be sampled directly, pointing into objects
+	Camera camera;
+	BVH bvh;
 
 
 	Scene() = default;
@@ -23,6 +29,34 @@ struct Scene
 
 		for (const SceneObject * const o : s.objects)
 			objects.push_back(o->clone());
+
+		updateLights();
+		bvh = s.bvh; // Refers to objects by index, so it's valid for the clones
+
+		camera = s.camera;
+	}
+
+	// Rebuild the light list and BVH, needs to be called after changing objects
+	void update()
+	{
+		updateLights();
+		bvh.build(objects);
+	}
+
+	void updateLights()
+	{
+		lights.resize(0);
+
+		for (SceneObject * const o : objects)
+			if (isLight(o))
+				lights.push_back(o);
+	}
+
+	// Emission from colouring functions varies over the surface, so only constant emitters go in the light list
+	static bool isLight(const SceneObject * o) noexcept
+	{
+		const vec3f & e = o->mat.emission;
+		return o->canSampleDirection() && o->mat.colouring == nullptr && (e.x() > 0 || e.y() > 0 || e.z() > 0);
 	}
 
 	// Scene owns all the object pointers, so delete them
@@ -34,19 +68,25 @@ struct Scene
 
 	std::pair<SceneObject *, real> nearestIntersection(const Ray & r) noexcept
 	{
-		SceneObject * nearest_obj = nullptr;
-		real nearest_t = real_inf;
+		return bvh.nearestIntersection(objects, r);
+	}
 
+	// Nearest intersection of a ray known not to hit anything before t_start, so the objects can start searching from there
+	std::pair<SceneObject *, real> nearestIntersection(const Ray & r, const real t_start) noexcept
+	{
+		if (t_start <= 0)
+			return nearestIntersection(r);
+
+		const auto [obj, t] = nearestIntersection(Ray{ r.o + r.d * t_start, r.d });
+		return { obj, t + t_start };
+	}
+
+	// Conservative distance from p to the nearest surface in the scene
+	real getDistance(const vec3r & p) noexcept
+	{
+		real nearest_dist = real_inf;
 		for (SceneObject * const o : objects)
-		{
-			const real hit_t = o->intersect(r);
-			if (hit_t > ray_epsilon && hit_t < nearest_t)
-			{
-				nearest_obj = o;
-				nearest_t = hit_t;
-			}
-		}
-
-		return { nearest_obj, nearest_t };
+			nearest_dist = std::min(nearest_dist, o->getDistance(p));
+		return nearest_dist;
 	}
 };
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "Scene.h"
+
+
+// Conservative distances along the camera rays of each cell of cell_size x cell_size pixels before which they can't hit
+//  anything, so that the camera ray intersections can skip the empty space in front of the scene.
+// A coarse pixel's hit distance doesn't bound the hits of the rays around it, so instead we march a cone containing all the
+//  rays of the cell with the scene's distance estimate, stepping only as far as the empty sphere still contains the cone.
+// Grids for finer levels of a multi-resolution render start their cones at the distances of the coarser grid.
+struct StartDistanceGrid
+{
+	static constexpr int cell_size = 4;
+	static constexpr int max_steps = 256;
+	static constexpr real max_distance = 1000; // Rays which get this far without getting near anything have missed
+
+	int xres = 0, yres = 0; // Of the level the grid is for, in pixels of scale x scale image pixels
+	int scale = 1;
+	int x_cells = 0, y_cells = 0;
+	std::vector<real> distances;
+
+
+	real get(const int x, const int y) const noexcept { return distances[(y / cell_size) * x_cells + x / cell_size]; }
+
+	// Build the grid for the still view of an image_xres * image_yres image, rendered with pixels of scale_ x scale_ image
+	//  pixels as the camera sets them up. Only valid when every object has a distance estimate, returns false otherwise.
+	// The coarser grid must be for the same image with cells at least as large as these.
+	bool build(const Scene & scene, const int image_xres, const int image_yres, const int scale_ = 1, const StartDistanceGrid * const coarser = nullptr)
+	{
+		Camera camera = scene.camera;
+		for (SceneObject * const o : scene.objects)
+			if (!(o->getDistance(camera.position) < real_inf))
+				return false;
+
+		scale = scale_;
+		xres = (image_xres + scale - 1) / scale;
+		yres = (image_yres + scale - 1) / scale;
+		x_cells = (xres + cell_size - 1) / cell_size;
+		y_cells = (yres + cell_size - 1) / cell_size;
+		distances.resize((size_t)x_cells * y_cells);
+		camera.setFrame(0, 0, image_xres, image_yres, 0, 0, scale);
+
+		// The distance estimates can change the objects' state, so each thread needs its own copy
+		#pragma omp parallel
+		{
+			Scene thread_scene(scene);
+
+			#pragma omp for schedule(dynamic)
+			for (int cell_y = 0; cell_y < y_cells; ++cell_y)
+			for (int cell_x = 0; cell_x < x_cells; ++cell_x)
+			{
+				// Pixel filter offsets go up to a pixel either side
+				const real x0 = (real)cell_x * cell_size - 1, x1 = (real)(cell_x + 1) * cell_size;
+				const real y0 = (real)cell_y * cell_size - 1, y1 = (real)(cell_y + 1) * cell_size;
+
+				// Start from the coarser cells covering this one, at the corners of the rectangle. The levels' pixels are centred
+				//  on their blocks of image pixels, so the coarser pixel containing a point is just a matter of the scales.
+				real t = 0;
+				if (coarser)
+				{
+					const real to_coarser = (real)scale / coarser->scale;
+					t = real_inf;
+					for (const real y : { y0, y1 })
+					for (const real x : { x0, x1 })
+						t = std::min(t, coarser->get(
+							std::max(0, std::min(coarser->xres - 1, (int)std::floor((x + (real)0.5) * to_coarser))),
+							std::max(0, std::min(coarser->yres - 1, (int)std::floor((y + (real)0.5) * to_coarser)))));
+				}
+
+				real base_radius, spread;
+				const Ray axis = camera.pixelCone(x0, x1, y0, y1, base_radius, spread);
+				for (int step = 0; step < max_steps; ++step)
+				{
+					// Any point of the cone in the next step is within step + radius of the current point
+					const real cone_radius = base_radius + t * spread;
+					const real dist = thread_scene.getDistance(axis.o + axis.d * t);
+					const real step_length = (dist - cone_radius) / (1 + spread);
+					if (!(step_length > std::max(ray_epsilon, cone_radius * (real)0.1)))
+						break;
+					t = std::min(t + step_length, max_distance);
+					if (t == max_distance)
+						break;
+				}
+
+				// Back off so the first point the objects check is no further than t
+				distances[(size_t)cell_y * x_cells + cell_x] = std::max((real)0, t - 2 * ray_epsilon);
+			}
+		}
+		return true;
+	}
+};
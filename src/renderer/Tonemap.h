@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "maths/vec.h"
+
+
+enum TonemapCurve { tonemap_linear, tonemap_filmic };
+
+struct TonemapSettings
+{
+	float exposure = 0; // In stops
+	TonemapCurve curve = tonemap_linear;
+};
+
+
+// Filmic curve fitted to the ACES reference rendering transform, maps [0, inf) to [0, 1)
+// Ref: "ACES Filmic Tone Mapping Curve", Narkowicz 2016
+inline float filmicACES(const float x) noexcept
+{
+	return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+}
+
+
+// Linear [0, 1] to 8-bit sRGB, giving exactly the same codes as floor(min(255, sRGB(v) * 256)) without evaluating pow.
+// The table holds the code at 4096 evenly spaced values, which is fine enough that the code changes at most once within
+//  an entry, and the smallest value that gets each code to correct for that.
+struct SRGBTable
+{
+	int32_t code[4097];
+	float threshold[257]; // threshold[c] is the smallest value with code c
+
+	static int encode(const float u) noexcept
+	{
+		const float s = (u <= 0.0031308f) ? 12.92f * u : 1.055f * std::pow(u, 0.416667f) - 0.055f;
+		return (int)std::max(0.0f, std::min(255.0f, s * 256));
+	}
+
+	SRGBTable() noexcept
+	{
+		for (int i = 0; i <= 4096; ++i)
+			code[i] = encode(i / 4096.0f);
+
+		// Binary search the bit patterns of the floats in [0, 1], which are in the same order as the values
+		const auto as_float = [](const uint32_t bits) { float f; memcpy(&f, &bits, 4); return f; };
+		constexpr uint32_t one_bits = 0x3F800000;
+		threshold[0] = 0;
+		for (int c = 1; c <= 255; ++c)
+		{
+			uint32_t lo = 0, hi = one_bits;
+			while (lo < hi)
+			{
+				const uint32_t mid = lo + (hi - lo) / 2;
+				if (encode(as_float(mid)) >= c) hi = mid; else lo = mid + 1;
+			}
+			threshold[c] = as_float(lo);
+		}
+		threshold[256] = std::numeric_limits<float>::infinity();
+	}
+
+	// NaNs map to 255 like infinities, so they show up as bright pixels
+	int operator()(const float x) const noexcept
+	{
+		const float v = std::max(0.0f, std::min(1.0f, x));
+		const int c = code[(int)(v * 4096)];
+		return c + (v >= threshold[c + 1]);
+	}
+};
+
+inline const SRGBTable & sRGBTable() noexcept
+{
+	static const SRGBTable table;
+	return table;
+}
+
+
+// Scale, tonemap and convert a row of pixels to 8-bit sRGB, with samples giving the per-pixel sample counts to normalise by
+//  (or nullptr if the values are already normalised). With AVX2 we do 8 pixels at a time, as 24 values which are
+//  processed the same regardless of channel.
+inline void tonemapRow(uint8_t * const out, const vec3f * const in, const int * const samples, const int num_pixels, const TonemapSettings & settings) noexcept
+{
+	const SRGBTable & table = sRGBTable();
+	const float exposure_scale = std::exp2(settings.exposure);
+	const bool filmic = settings.curve == tonemap_filmic;
+
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256 k = _mm256_set1_ps(exposure_scale);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one  = _mm256_set1_ps(1.0f);
+	const __m256i spread[3] =
+	{
+		_mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2),
+		_mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5),
+		_mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7)
+	};
+
+	for (; i + 8 <= num_pixels; i += 8)
+	{
+		__m256 scale = k;
+		if (samples != nullptr)
+		{
+			const __m256i n = _mm256_loadu_si256((const __m256i *)(samples + i));
+			const __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(n, _mm256_setzero_si256()));
+			scale = _mm256_and_ps(_mm256_div_ps(k, _mm256_cvtepi32_ps(n)), valid);
+		}
+
+		__m256i codes[3];
+		for (int j = 0; j < 3; ++j)
+		{
+			__m256 x = _mm256_mul_ps(_mm256_loadu_ps(&in[i].e[0] + j * 8), _mm256_permutevar8x32_ps(scale, spread[j]));
+			if (filmic)
+			{
+				const __m256 num = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+				const __m256 den = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+				x = _mm256_div_ps(num, den);
+			}
+
+			// Same as the scalar version, min returns the second operand for NaNs
+			const __m256 v = _mm256_max_ps(_mm256_min_ps(x, one), zero);
+			const __m256i c = _mm256_i32gather_epi32(table.code, _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(4096.0f))), 4);
+			const __m256 t = _mm256_i32gather_ps(table.threshold + 1, c, 4);
+			codes[j] = _mm256_sub_epi32(c, _mm256_castps_si256(_mm256_cmp_ps(v, t, _CMP_GE_OQ)));
+		}
+
+		// Pack the 24 codes to bytes, fixing up the order since the packs work within 128-bit lanes
+		const __m256i ab = _mm256_permute4x64_epi64(_mm256_packus_epi32(codes[0], codes[1]), 0xD8);
+		const __m256i cc = _mm256_permute4x64_epi64(_mm256_packus_epi32(codes[2], codes[2]), 0xD8);
+		const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cc), 0xD8);
+		_mm_storeu_si128((__m128i *)(out + (size_t)i * 3), _mm256_castsi256_si128(bytes));
+		_mm_storel_epi64((__m128i *)(out + (size_t)i * 3 + 16), _mm256_extracti128_si256(bytes, 1));
+	}
+#endif
+
+	for (; i < num_pixels; ++i)
+	{
+		const float scale = (samples == nullptr) ? exposure_scale : (samples[i] > 0) ? exposure_scale / samples[i] : 0.0f;
+		uint8_t * const pixel = out + (size_t)i * 3;
+		for (int j = 0; j < 3; ++j)
+		{
+			const float x = in[i].e[j] * scale;
+			pixel[j] = (uint8_t)table(filmic ? filmicACES(x) : x);
+		}
+	}
+}
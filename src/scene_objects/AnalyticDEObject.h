@@ -36,6 +36,21 @@ struct AnalyticDEObject : public SceneObject
 		return normalise(grad);
 	}
 
+	// Outside the bounding sphere, bound the distance with the estimate at the nearest point on it, as for DualDEObject
+	virtual real getDistance(const vec3r & p) noexcept override final
+	{
+		const vec3r offset = p - centre;
+		const real  r = length(offset);
+		const real DE = getDE((r > radius) ? offset * (radius / r) : offset) * step_scale;
+		if (r <= radius)
+			return DE;
+
+		const real s = r - radius, d = std::max((real)0, DE);
+		return std::sqrt(s * s + d * d);
+	}
+
+	virtual bool getBounds(vec3r & lo, vec3r & hi) const noexcept override final { lo = centre - radius; hi = centre + radius; return true; }
+
 	virtual real intersect(const Ray & r) noexcept override final
 	{
 		const vec3r s = r.o - centre;
@@ -52,16 +67,18 @@ struct AnalyticDEObject : public SceneObject
 		if (t2 <= ray_epsilon) return -1;
 
 		// Ray could be inside bounding sphere, start from ray epsilon
-		real t = std::max(ray_epsilon, t1);
+		const real t_entry = std::max(ray_epsilon, t1);
+		real t = t_entry;
 		while (t < t2)
 		{
 			const vec3r p_os = s + r.d * t;
 			const real DE = getDE(p_os) * step_scale;
 			t += DE;
 
-			// If we're close enough to the surface, return a valid intersection
+			// If we're close enough to the surface, return a valid intersection. Where the sphere cuts into the fractal the
+			//  estimate is negative on entry, and the surface is the sphere itself rather than anything in front of it.
 			if (DE < DE_thresh)
-				return t;
+				return std::max(t, t_entry);
 		}
 
 		return -1; // No intersection found
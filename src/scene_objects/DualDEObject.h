@@ -439,6 +439,27 @@ struct DualDEObject : public SceneObject
 		return normal_os;
 	}
 
+	// The estimates can be far too large well outside the bounding sphere, where intersect() never evaluates them. So outside
+	//  it we estimate at the nearest point on the sphere instead: the surfaces are inside the sphere and at least DE from that
+	//  point, which puts them at least sqrt(s^2 + DE^2) away for s the distance to the sphere.
+	virtual real getDistance(const vec3r & p) noexcept override final
+	{
+		const vec3r offset = p - centre;
+		const real  r = length(offset);
+		const vec3r p_os = ((r > radius) ? offset * (radius / r) : offset) / scene_scale;
+		const DualVec3r p_dual(Dual3r(p_os.x(), 0), Dual3r(p_os.y(), 1), Dual3r(p_os.z(), 2));
+
+		vec3r normal_ignored;
+		const real DE = getDE(p_dual, normal_ignored) * scene_scale * step_scale;
+		if (r <= radius)
+			return DE;
+
+		const real s = r - radius, d = std::max((real)0, DE);
+		return std::sqrt(s * s + d * d);
+	}
+
+	virtual bool getBounds(vec3r & lo, vec3r & hi) const noexcept override final { lo = centre - radius; hi = centre + radius; return true; }
+
 	virtual real intersect(const Ray & r) noexcept override final
 	{
 		const vec3r s = r.o - centre;
@@ -459,7 +480,8 @@ struct DualDEObject : public SceneObject
 		const real inv_scene_scale = 1 / scene_scale;
 
 		// Ray could be inside bounding sphere, start from ray epsilon
-		real t = std::max(ray_epsilon, t1);
+		const real t_entry = std::max(ray_epsilon, t1);
+		real t = t_entry;
 		while (t < t2)
 		{
 			// Transform from world space to object space
@@ -472,9 +494,10 @@ struct DualDEObject : public SceneObject
 			(void) normal_ignored;
 			t += DE;
 
-			// If we're close enough to the surface, return a valid intersection
+			// If we're close enough to the surface, return a valid intersection. Where the sphere cuts into the fractal the
+			//  estimate is negative on entry, and the surface is the sphere itself rather than anything in front of it.
 			if (DE < thresh)
-				return t;
+				return std::max(t, t_entry);
 		}
 
 		return -1; // No intersection found
@@ -12,8 +12,23 @@ struct SceneObject
 	virtual real  intersect(const Ray   & r) noexcept = 0;
 	virtual vec3r getNormal(const vec3r & p) noexcept = 0;
 
+	// Conservative estimate of the distance from p to the surface, infinite for objects that don't provide one
+	virtual real getDistance(const vec3r & /*p*/) noexcept { return real_inf; }
+
+	// Axis-aligned box containing all of the surface, returns false for unbounded objects
+	virtual bool getBounds(vec3r & /*lo*/, vec3r & /*hi*/) const noexcept { return false; }
+
 	virtual SceneObject * clone() const = 0;
 
+	// Direct light sampling for next event estimation, only for objects that can be sampled by solid angle
+	virtual bool canSampleDirection() const noexcept { return false; }
+
+	// Sample a direction from p towards the object, returns the solid angle pdf or zero if it can't be sampled
+	virtual real sampleDirection(const vec3r & /*p*/, const vec2r & /*u*/, vec3r & /*dir_out*/) const noexcept { return 0; }
+
+	// Solid angle pdf of sampleDirection generating dir from p, assuming the ray along dir hits the object
+	virtual real directionPdf(const vec3r & /*p*/, const vec3r & /*dir*/) const noexcept { return 0; }
+
 
 	Material mat;
 };
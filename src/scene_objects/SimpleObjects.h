@@ -31,6 +31,45 @@ struct Sphere final : public SceneObject
 		return (p - centre) * (1 / radius);
 	}
 
+	virtual real getDistance(const vec3r & p) noexcept override { return std::fabs(length(p - centre) - radius); }
+
+	virtual bool getBounds(vec3r & lo, vec3r & hi) const noexcept override { lo = centre - radius; hi = centre + radius; return true; }
+
+	virtual bool canSampleDirection() const noexcept override { return true; }
+
+	// Uniformly sample the cone of directions subtended by the sphere
+	// Ref: https://pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources#SamplingSpheres
+	virtual real sampleDirection(const vec3r & p, const vec2r & u, vec3r & dir_out) const noexcept override
+	{
+		const vec3r to_centre = centre - p;
+		const real  dist2 = dot(to_centre, to_centre);
+		const real  sin2_max = radius * radius / dist2;
+		if (sin2_max >= 1)
+			return 0; // Inside the sphere
+
+		const real one_minus_cos_max = sin2_max / (1 + std::sqrt(1 - sin2_max)); // Avoids cancellation for small cones
+		const real cos_theta = 1 - u.x() * one_minus_cos_max;
+		const real sin_theta = std::sqrt(std::max((real)0, 1 - cos_theta * cos_theta));
+		const real phi = two_pi * u.y();
+
+		const vec3r w = to_centre * (1 / std::sqrt(dist2));
+		vec3r t, b;
+		orthonormalBasis(w, t, b);
+		dir_out = w * cos_theta + (t * std::cos(phi) + b * std::sin(phi)) * sin_theta;
+
+		return 1 / (two_pi * one_minus_cos_max);
+	}
+
+	virtual real directionPdf(const vec3r & p, const vec3r & /*dir*/) const noexcept override
+	{
+		const vec3r to_centre = centre - p;
+		const real  sin2_max = radius * radius / dot(to_centre, to_centre);
+		if (sin2_max >= 1)
+			return 0;
+
+		return 1 / (two_pi * sin2_max / (1 + std::sqrt(1 - sin2_max)));
+	}
+
 	virtual SceneObject * clone() const override final
 	{
 		Sphere * o = new Sphere;
@@ -68,6 +107,29 @@ struct Quad final : public SceneObject
 
 	virtual vec3r getNormal(const vec3r & p) noexcept override { (void) p; return n; }
 
+	// Distance to the closest point of the quad, clamping the projection onto the plane to the edges
+	virtual real getDistance(const vec3r & q) noexcept override
+	{
+		const vec3r s = q - p;
+		const real  a = std::max((real)0, std::min((real)1, dot(s, v0)));
+		const real  b = std::max((real)0, std::min((real)1, dot(s, v1)));
+		return length(s - u * a - v * b);
+	}
+
+	virtual bool getBounds(vec3r & lo, vec3r & hi) const noexcept override
+	{
+		const vec3r corners[3] = { p + u, p + v, p + u + v };
+		lo = p;
+		hi = p;
+		for (const vec3r & c : corners)
+		for (int k = 0; k < 3; ++k)
+		{
+			lo.e[k] = std::min(lo.e[k], c.e[k]);
+			hi.e[k] = std::max(hi.e[k], c.e[k]);
+		}
+		return true;
+	}
+
 	virtual SceneObject * clone() const override final
 	{
 		Quad * o = new Quad(p, u, v);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <cstdio>
+
+#if _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+// Files are written to a temporary next to the destination and then moved over it in one step, so that readers and
+//  crashes only ever see the old or the new file complete.
+
+// Temporary path for writing a file before it replaces path, unique to the process and call so concurrent writers don't collide
+inline std::string atomicTempPath(const std::string & path)
+{
+	static std::atomic<unsigned> counter { 0 };
+#if _WIN32
+	const unsigned long pid = GetCurrentProcessId();
+#else
+	const unsigned long pid = (unsigned long)getpid();
+#endif
+	return path + "." + std::to_string(pid) + "." + std::to_string(counter++) + ".tmp";
+}
+
+// Move a finished temporary file over path, replacing any existing file without removing it first.
+// If that fails the existing file is untouched and the temporary is deleted.
+inline bool atomicReplace(const std::string & temp_path, const std::string & path)
+{
+#if _WIN32
+	const bool ok = MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	const bool ok = std::rename(temp_path.c_str(), path.c_str()) == 0;
+#endif
+	if (!ok)
+		std::remove(temp_path.c_str());
+	return ok;
+}
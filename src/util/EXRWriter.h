@@ -0,0 +1,276 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "maths/half.h"
+
+
+// Deflate from stb_image_write, which needs STB_IMAGE_WRITE_IMPLEMENTATION defined in one translation unit
+unsigned char * stbi_zlib_compress(unsigned char * data, int data_len, int * out_len, int quality);
+
+
+// Minimal OpenEXR writer for scanline images with any number of float channels, stored as half or float and either
+//  uncompressed or with ZIP compression. Layers are just channels named "layer.channel", e.g. "albedo.R".
+// Blocks of scanlines are converted and compressed in parallel, then written out in order.
+// EXRTiledWriter streams tiled files instead, for images too large to keep in memory.
+// Ref: "The OpenEXR File Layout", https://openexr.com/en/latest/OpenEXRFileLayout.html
+enum EXRPixelType { exr_half = 1, exr_float = 2 };
+enum EXRCompression { exr_uncompressed = 0, exr_zip = 3 };
+
+struct EXRChannel
+{
+	std::string name;
+	const float * data; // Value for the first pixel
+	int stride;         // Distance between consecutive pixels in floats
+};
+
+
+// Convert lines [y0, y1) of a width pixels wide image to the file's pixel type and compress them, as one block of a
+//  scanline file or one tile of a tiled file. The channels must be in alphabetical order.
+inline std::vector<uint8_t> encodeEXRBlock(const std::vector<EXRChannel> & channels, const int width, const int y0, const int y1,
+	const EXRPixelType pixel_type, const EXRCompression compression)
+{
+	const int value_size = (pixel_type == exr_half) ? 2 : 4;
+
+	// Each block holds its scanlines one after the other, with all the pixels of each channel in turn
+	std::vector<uint8_t> raw((size_t)width * channels.size() * value_size * (y1 - y0));
+	uint8_t * out = raw.data();
+	for (int y = y0; y < y1; ++y)
+	for (const EXRChannel & c : channels)
+	{
+		const float * in = c.data + (size_t)y * width * c.stride;
+		if (pixel_type == exr_half)
+			for (int x = 0; x < width; ++x, out += 2)
+			{
+				const uint16_t h = floatToHalf(in[(size_t)x * c.stride]);
+				memcpy(out, &h, 2);
+			}
+		else
+			for (int x = 0; x < width; ++x, out += 4)
+				memcpy(out, &in[(size_t)x * c.stride], 4);
+	}
+
+	if (compression == exr_uncompressed)
+		return raw;
+
+	// Split the low and high bytes of the values into two halves, then delta encode the bytes before deflating
+	const size_t size = raw.size();
+	std::vector<uint8_t> predicted(size);
+	for (size_t i = 0; i < size; ++i)
+		predicted[(i & 1) ? (size + 1) / 2 + i / 2 : i / 2] = raw[i];
+	for (size_t i = size - 1; i > 0; --i)
+		predicted[i] = (uint8_t)(predicted[i] - predicted[i - 1] + 128);
+
+	int compressed_size = 0;
+	unsigned char * const compressed = stbi_zlib_compress(predicted.data(), (int)size, &compressed_size, 5);
+
+	// Blocks that don't get smaller are stored uncompressed, which readers detect by the size
+	std::vector<uint8_t> block;
+	if (compressed != nullptr && (size_t)compressed_size < size)
+		block.assign(compressed, compressed + compressed_size);
+	else
+		block = std::move(raw);
+	free(compressed);
+	return block;
+}
+
+
+// Header of a single part file, tiled if tile_size > 0, up to and including the end of header byte
+inline std::vector<uint8_t> makeEXRHeader(const std::vector<EXRChannel> & channels, const int xres, const int yres,
+	const EXRPixelType pixel_type, const EXRCompression compression, const int tile_size = 0)
+{
+	std::vector<uint8_t> header;
+	const auto add = [&](const void * data, const size_t size) { header.insert(header.end(), (const uint8_t *)data, (const uint8_t *)data + size); };
+	const auto addString = [&](const char * s) { add(s, strlen(s) + 1); };
+	const auto addInt = [&](const int32_t v) { add(&v, 4); };
+	const auto addFloat = [&](const float v) { add(&v, 4); };
+	const auto addAttribute = [&](const char * name, const char * type, const int32_t size)
+	{
+		addString(name);
+		addString(type);
+		addInt(size);
+	};
+
+	const uint8_t magic[4] = { 0x76, 0x2F, 0x31, 0x01 };
+	add(magic, 4);
+	addInt((tile_size > 0) ? 2 | 0x200 : 2); // Version 2, single part scanline or tiled file with short names
+
+	int32_t channels_size = 1;
+	for (const EXRChannel & c : channels)
+		channels_size += (int32_t)c.name.size() + 1 + 16;
+	addAttribute("channels", "chlist", channels_size);
+	for (const EXRChannel & c : channels)
+	{
+		const uint8_t linear_and_reserved[4] = { 0, 0, 0, 0 };
+		addString(c.name.c_str());
+		addInt(pixel_type);
+		add(linear_and_reserved, 4);
+		addInt(1); // x and y sampling
+		addInt(1);
+	}
+	header.push_back(0);
+
+	addAttribute("compression", "compression", 1);
+	header.push_back((uint8_t)compression);
+
+	for (const char * window : { "dataWindow", "displayWindow" })
+	{
+		addAttribute(window, "box2i", 16);
+		addInt(0);
+		addInt(0);
+		addInt(xres - 1);
+		addInt(yres - 1);
+	}
+
+	// Tiles can be written in any order, scanline blocks are written top to bottom
+	addAttribute("lineOrder", "lineOrder", 1);
+	header.push_back((tile_size > 0) ? 2 : 0);
+
+	addAttribute("pixelAspectRatio", "float", 4);
+	addFloat(1);
+
+	addAttribute("screenWindowCenter", "v2f", 8);
+	addFloat(0);
+	addFloat(0);
+
+	addAttribute("screenWindowWidth", "float", 4);
+	addFloat(1);
+
+	if (tile_size > 0)
+	{
+		addAttribute("tiles", "tiledesc", 9);
+		addInt(tile_size);
+		addInt(tile_size);
+		header.push_back(0); // One level, no mipmaps
+	}
+
+	header.push_back(0); // End of header
+	return header;
+}
+
+
+// Write an xres * yres image, returns false if the file couldn't be written. Assumes a little-endian machine like the rest of the code.
+inline bool writeEXR(const char * const path, const int xres, const int yres, std::vector<EXRChannel> channels,
+	const EXRPixelType pixel_type = exr_half, const EXRCompression compression = exr_zip)
+{
+	// Channels are stored in alphabetical order
+	std::sort(channels.begin(), channels.end(), [](const EXRChannel & a, const EXRChannel & b) { return a.name < b.name; });
+
+	const int lines_per_block = (compression == exr_zip) ? 16 : 1;
+	const int num_blocks = (yres + lines_per_block - 1) / lines_per_block;
+
+	std::vector<std::vector<uint8_t>> blocks(num_blocks);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int block = 0; block < num_blocks; ++block)
+	{
+		const int y0 = block * lines_per_block;
+		const int y1 = std::min(y0 + lines_per_block, yres);
+		blocks[block] = encodeEXRBlock(channels, xres, y0, y1, pixel_type, compression);
+	}
+
+	const std::vector<uint8_t> header = makeEXRHeader(channels, xres, yres, pixel_type, compression);
+
+	// Offset table with the position of each block in the file, which starts with its y coordinate and size
+	std::vector<uint64_t> offsets(num_blocks);
+	uint64_t offset = header.size() + sizeof(uint64_t) * num_blocks;
+	for (int block = 0; block < num_blocks; ++block)
+	{
+		offsets[block] = offset;
+		offset += 8 + blocks[block].size();
+	}
+
+	FILE * const f = fopen(path, "wb");
+	if (f == nullptr)
+		return false;
+
+	bool ok =
+		fwrite(header.data(), 1, header.size(), f) == header.size() &&
+		fwrite(offsets.data(), sizeof(uint64_t), num_blocks, f) == (size_t)num_blocks;
+
+	for (int block = 0; block < num_blocks && ok; ++block)
+	{
+		const int32_t block_header[2] = { block * lines_per_block, (int32_t)blocks[block].size() };
+		ok =
+			fwrite(block_header, sizeof(int32_t), 2, f) == 2 &&
+			fwrite(blocks[block].data(), 1, blocks[block].size(), f) == blocks[block].size();
+	}
+
+	return (fclose(f) == 0) && ok;
+}
+
+
+// Writes a tiled file one tile at a time as they're finished, so only the tile being written needs to be in memory.
+// The offset table is written as zeros by open() and filled in by finish(), which must be called once all tiles are written.
+struct EXRTiledWriter
+{
+	~EXRTiledWriter() { if (file != nullptr) fclose(file); }
+
+	// Channel data pointers are ignored here, only the names are used
+	bool open(const char * const path, const int xres_, const int yres_, const int tile_size_, std::vector<EXRChannel> channels,
+		const EXRPixelType pixel_type_ = exr_half, const EXRCompression compression_ = exr_zip)
+	{
+		xres = xres_;
+		yres = yres_;
+		tile_size = tile_size_;
+		pixel_type = pixel_type_;
+		compression = compression_;
+		x_tiles = (xres + tile_size - 1) / tile_size;
+		offsets.assign((size_t)x_tiles * ((yres + tile_size - 1) / tile_size), 0);
+
+		std::sort(channels.begin(), channels.end(), [](const EXRChannel & a, const EXRChannel & b) { return a.name < b.name; });
+		const std::vector<uint8_t> header = makeEXRHeader(channels, xres, yres, pixel_type, compression, tile_size);
+
+		file = fopen(path, "wb");
+		if (file == nullptr)
+			return false;
+
+		offset_table_pos = header.size();
+		next_offset = offset_table_pos + sizeof(uint64_t) * offsets.size();
+		return
+			fwrite(header.data(), 1, header.size(), file) == header.size() &&
+			fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+	}
+
+	// Write tile (tile_x, tile_y), with channel data for just the pixels of the tile, which is smaller at the right and bottom edges
+	bool writeTile(const int tile_x, const int tile_y, std::vector<EXRChannel> channels)
+	{
+		std::sort(channels.begin(), channels.end(), [](const EXRChannel & a, const EXRChannel & b) { return a.name < b.name; });
+
+		const int width  = std::min(tile_size, xres - tile_x * tile_size);
+		const int height = std::min(tile_size, yres - tile_y * tile_size);
+		const std::vector<uint8_t> data = encodeEXRBlock(channels, width, 0, height, pixel_type, compression);
+
+		// Tiles start with their coordinates, mip level and size
+		const int32_t tile_header[5] = { tile_x, tile_y, 0, 0, (int32_t)data.size() };
+		offsets[(size_t)tile_y * x_tiles + tile_x] = next_offset;
+		next_offset += sizeof(tile_header) + data.size();
+		return
+			fwrite(tile_header, sizeof(int32_t), 5, file) == 5 &&
+			fwrite(data.data(), 1, data.size(), file) == data.size();
+	}
+
+	bool finish()
+	{
+		bool ok =
+			fseek(file, (long)offset_table_pos, SEEK_SET) == 0 &&
+			fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+		ok = (fclose(file) == 0) && ok;
+		file = nullptr;
+		return ok;
+	}
+
+private:
+	FILE * file = nullptr;
+	int xres = 0, yres = 0, tile_size = 0, x_tiles = 0;
+	EXRPixelType pixel_type = exr_half;
+	EXRCompression compression = exr_zip;
+	std::vector<uint64_t> offsets; // Position of each tile in the file, in raster order
+	uint64_t offset_table_pos = 0, next_offset = 0;
+};
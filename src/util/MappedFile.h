@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#if _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// Read-only memory mapping of a whole file, pages are loaded on demand by the OS
+struct MappedFile
+{
+	const uint8_t * data = nullptr;
+	size_t size = 0;
+
+	MappedFile() noexcept = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const std::string & path) noexcept
+	{
+		close();
+#if _WIN32
+		const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER file_size;
+		const HANDLE mapping = (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) ?
+			CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		CloseHandle(file);
+		if (mapping == nullptr) return false;
+
+		const void * const view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping); // The view keeps the mapping alive
+		if (view == nullptr) return false;
+
+		data = (const uint8_t *)view;
+		size = (size_t)file_size.QuadPart;
+#else
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		void * const view = (fstat(fd, &st) == 0 && st.st_size > 0) ?
+			mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd); // The mapping keeps the file alive
+		if (view == MAP_FAILED) return false;
+
+		data = (const uint8_t *)view;
+		size = (size_t)st.st_size;
+#endif
+		return true;
+	}
+
+	void close() noexcept
+	{
+		if (data == nullptr) return;
+#if _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void *)data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+};
+
+
+// Array which either owns its elements or points into externally owned memory such as a MappedFile.
+// Only owned arrays may be written to, mapped ones are typically on read-only pages.
+template <typename T>
+struct MappedArray
+{
+	MappedArray() noexcept = default;
+	MappedArray(const MappedArray &) = delete;
+	MappedArray & operator=(const MappedArray &) = delete;
+
+	// Moving a vector keeps its heap buffer, so the pointer stays valid
+	MappedArray(MappedArray && rhs) noexcept : owned(std::move(rhs.owned)), ptr(rhs.ptr), count(rhs.count) { rhs.ptr = nullptr; rhs.count = 0; }
+	MappedArray & operator=(MappedArray && rhs) noexcept
+	{
+		owned = std::move(rhs.owned); ptr = rhs.ptr; count = rhs.count;
+		rhs.ptr = nullptr; rhs.count = 0;
+		return *this;
+	}
+
+	void resize(const size_t n)
+	{
+		owned.clear();
+		owned.resize(n);
+		ptr = owned.data();
+		count = n;
+	}
+
+	void resize(const size_t n, const T & value)
+	{
+		owned.assign(n, value);
+		ptr = owned.data();
+		count = n;
+	}
+
+	void map(const T * const p, const size_t n) noexcept
+	{
+		owned.clear(); owned.shrink_to_fit();
+		ptr = const_cast<T *>(p);
+		count = n;
+	}
+
+	void clear() noexcept { map(nullptr, 0); }
+
+	bool isMapped() const noexcept { return ptr != nullptr && owned.empty(); }
+	bool empty() const noexcept { return count == 0; }
+	size_t size() const noexcept { return count; }
+
+	      T * data()       noexcept { return ptr; }
+	const T * data() const noexcept { return ptr; }
+
+	      T & operator[](const size_t i)       noexcept { return ptr[i]; }
+	const T & operator[](const size_t i) const noexcept { return ptr[i]; }
+
+private:
+	std::vector<T> owned;
+	T * ptr = nullptr;
+	size_t count = 0;
+};
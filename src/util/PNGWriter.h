@@ -0,0 +1,364 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+
+// Fast 8-bit RGB PNG writer. The image is split into strips of rows which are filtered and deflated in parallel, each
+//  into its own IDAT chunk. The strips are compressed independently and end with an empty stored block to get back to a
+//  byte boundary (a "sync flush" as in zlib and pigz), so that they join up into a single valid zlib stream.
+// The deflate encoder uses the fixed Huffman codes like stb_image_write, with hash chains to find matches.
+// Ref: RFC 1950 (zlib), RFC 1951 (deflate), https://www.w3.org/TR/png/
+namespace png_detail
+{
+	constexpr int strip_rows = 32;      // Rows per strip, which is also the unit of parallelism
+	constexpr int hash_bits = 15;
+	constexpr int max_chain = 12;       // Hash chain entries to try for each match
+	constexpr int window_size = 32768;
+	constexpr int min_match = 3, max_match = 258;
+
+	struct Tables
+	{
+		uint32_t crc[256];
+		uint16_t lit_code[288]; // Bit-reversed fixed Huffman codes and their lengths
+		uint8_t  lit_bits[288];
+		uint16_t len_sym[max_match + 1]; // Length code, extra bits and their value for each match length
+		uint8_t  len_extra_bits[max_match + 1];
+		uint16_t len_extra[max_match + 1];
+
+		Tables() noexcept
+		{
+			for (uint32_t n = 0; n < 256; ++n)
+			{
+				uint32_t c = n;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				crc[n] = c;
+			}
+
+			for (int s = 0; s < 288; ++s)
+			{
+				int code, bits;
+				if      (s < 144) { code = 0x30  + s;         bits = 8; }
+				else if (s < 256) { code = 0x190 + s - 144;   bits = 9; }
+				else if (s < 280) { code = s - 256;           bits = 7; }
+				else              { code = 0xC0  + s - 280;   bits = 8; }
+				lit_code[s] = (uint16_t)reverse(code, bits);
+				lit_bits[s] = (uint8_t)bits;
+			}
+
+			static const int len_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+			static const int len_bits[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+			for (int code = 0; code < 29; ++code)
+			for (int len = len_base[code]; len < len_base[code] + (1 << len_bits[code]) && len <= max_match; ++len)
+			{
+				len_sym[len] = (uint16_t)(257 + code);
+				len_extra_bits[len] = (uint8_t)len_bits[code];
+				len_extra[len] = (uint16_t)(len - len_base[code]);
+			}
+		}
+
+		static uint32_t reverse(uint32_t v, const int bits) noexcept
+		{
+			uint32_t r = 0;
+			for (int i = 0; i < bits; ++i, v >>= 1)
+				r = (r << 1) | (v & 1);
+			return r;
+		}
+	};
+
+	inline const Tables & tables() noexcept
+	{
+		static const Tables t;
+		return t;
+	}
+
+	inline uint32_t crc32(uint32_t crc, const uint8_t * data, const size_t size) noexcept
+	{
+		const Tables & t = tables();
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = t.crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline uint32_t adler32(const uint8_t * data, size_t size) noexcept
+	{
+		uint32_t a = 1, b = 0;
+		while (size > 0)
+		{
+			const size_t n = std::min(size, (size_t)5552); // Most bytes we can sum before the 32-bit sums could overflow
+			for (size_t i = 0; i < n; ++i)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += n;
+			size -= n;
+		}
+		return (b << 16) | a;
+	}
+
+	// Checksum of the concatenation of two pieces of data, given their checksums and the length of the second (from zlib)
+	inline uint32_t adler32Combine(const uint32_t adler1, const uint32_t adler2, const size_t len2) noexcept
+	{
+		constexpr uint32_t base = 65521;
+		const uint32_t rem = (uint32_t)(len2 % base);
+		uint32_t sum1 = adler1 & 0xFFFF;
+		uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+		sum1 += (adler2 & 0xFFFF) + base - 1;
+		sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - rem;
+		if (sum1 >= base) sum1 -= base;
+		if (sum1 >= base) sum1 -= base;
+		if (sum2 >= base << 1) sum2 -= base << 1;
+		if (sum2 >= base) sum2 -= base;
+		return sum1 | (sum2 << 16);
+	}
+
+	struct BitWriter
+	{
+		std::vector<uint8_t> & out;
+		uint64_t bits = 0;
+		int count = 0;
+
+		void put(const uint32_t value, const int num_bits) noexcept
+		{
+			bits |= (uint64_t)value << count;
+			count += num_bits;
+			while (count >= 8)
+			{
+				out.push_back((uint8_t)bits);
+				bits >>= 8;
+				count -= 8;
+			}
+		}
+
+		void align() noexcept { if (count > 0) put(0, 8 - count); }
+	};
+
+	// Deflate data as one fixed Huffman block, then either finish the stream or flush to a byte boundary so the next
+	//  piece can be appended. Matches don't reach before the start of the data.
+	inline void deflate(const uint8_t * const data, const int size, const bool last, std::vector<uint8_t> & out)
+	{
+		const Tables & t = tables();
+		BitWriter w = { out };
+		w.put(last ? 1 : 0, 1); // BFINAL
+		w.put(1, 2);            // BTYPE = fixed Huffman
+
+		std::vector<int32_t> head(1 << hash_bits, -1), prev(size);
+		const auto hash = [&](const int i) { return ((data[i] | data[i + 1] << 8 | data[i + 2] << 16) * 2654435761u) >> (32 - hash_bits); };
+		const auto insert = [&](const int i) { const uint32_t h = hash(i); prev[i] = head[h]; head[h] = i; };
+
+		// Longest match for position i in the hash chain, returns the length with the distance in dist
+		const auto find_match = [&](const int i, int & dist) -> int
+		{
+			const int limit = std::min(max_match, size - i);
+			int best = min_match - 1;
+			int chain = max_chain;
+			for (int j = head[hash(i)]; j >= 0 && i - j <= window_size && chain-- > 0; j = prev[j])
+			{
+				if (data[j + best] != data[i + best])
+					continue;
+				// Compare 8 bytes at a time until they differ, then finish off a byte at a time
+				int len = 0;
+				while (len + 8 <= limit)
+				{
+					uint64_t x, y;
+					memcpy(&x, data + j + len, 8);
+					memcpy(&y, data + i + len, 8);
+					if (x != y)
+						break;
+					len += 8;
+				}
+				while (len < limit && data[j + len] == data[i + len])
+					++len;
+				if (len > best)
+				{
+					best = len;
+					dist = i - j;
+					if (len == limit)
+						break;
+				}
+			}
+			return (best >= min_match) ? best : 0;
+		};
+
+		const auto put_literal = [&](const int lit) { w.put(t.lit_code[lit], t.lit_bits[lit]); };
+
+		int i = 0;
+		int len = -1, dist = 0; // Match at i if already found, negative if not
+		while (i < size - min_match)
+		{
+			if (len < 0)
+				len = find_match(i, dist);
+			insert(i);
+
+			// Lazy matching: emit a literal if the match at the next byte is longer, and carry on from that match
+			int next_len = -1, next_dist = 0;
+			if (len == 0 || (len < max_match && (next_len = find_match(i + 1, next_dist)) > len))
+			{
+				put_literal(data[i]);
+				++i;
+				len  = (i < size - min_match) ? next_len : -1;
+				dist = next_dist;
+				continue;
+			}
+
+			const int sym = t.len_sym[len];
+			w.put(t.lit_code[sym], t.lit_bits[sym]);
+			w.put(t.len_extra[len], t.len_extra_bits[len]);
+
+			// Distance code from the position of the top bit, with the bits below the top two as extra bits
+			const uint32_t d = (uint32_t)dist - 1;
+			int dist_code = (int)d, extra_bits = 0;
+			if (d >= 4)
+			{
+				int top = 31;
+				while (!(d >> top)) --top;
+				extra_bits = top - 1;
+				dist_code = 2 * top + ((d >> extra_bits) & 1);
+			}
+			w.put(Tables::reverse(dist_code, 5), 5);
+			w.put(d & ((1u << extra_bits) - 1), extra_bits);
+
+			for (int k = 1; k < len && i + k < size - min_match; ++k)
+				insert(i + k);
+			i += len;
+			len = -1;
+		}
+		for (; i < size; ++i)
+			put_literal(data[i]);
+
+		put_literal(256); // End of block
+		if (!last)
+		{
+			// Empty stored block, whose header is followed by padding to a byte boundary and then its length and complement
+			w.put(0, 3);
+			w.align();
+			const uint8_t sync[4] = { 0, 0, 0xFF, 0xFF };
+			out.insert(out.end(), sync, sync + 4);
+		}
+		else
+			w.align();
+	}
+
+	inline uint8_t paeth(const int a, const int b, const int c) noexcept
+	{
+		const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+		return (uint8_t)((pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c);
+	}
+
+	// Filter a row with each of the 5 filters and keep the one with the smallest sum of absolute values, which usually
+	//  compresses best. Writes the filter type byte followed by the filtered row, prev_row is all zeros for the first row.
+	inline void filterRow(const uint8_t * const row, const uint8_t * const prev_row, const int row_bytes, uint8_t * const out, std::vector<uint8_t> & temp)
+	{
+		constexpr int bpp = 3;
+		temp.resize(row_bytes);
+		int best_sum = INT32_MAX;
+		const auto try_filter = [&](const uint8_t filter, const auto & predict)
+		{
+			int sum = 0;
+			for (int i = 0; i < row_bytes; ++i)
+			{
+				const int a = (i >= bpp) ? row[i - bpp] : 0;
+				const int c = (i >= bpp) ? prev_row[i - bpp] : 0;
+				const uint8_t v = (uint8_t)(row[i] - predict(a, (int)prev_row[i], c));
+				temp[i] = v;
+				sum += std::abs((int)(int8_t)v);
+			}
+
+			if (sum < best_sum)
+			{
+				best_sum = sum;
+				out[0] = filter;
+				memcpy(out + 1, temp.data(), row_bytes);
+			}
+		};
+
+		try_filter(0, [](int, int, int) { return 0; });
+		try_filter(1, [](int a, int, int) { return a; });
+		try_filter(2, [](int, int b, int) { return b; });
+		try_filter(3, [](int a, int b, int) { return (a + b) >> 1; });
+		try_filter(4, [](int a, int b, int c) { return (int)paeth(a, b, c); });
+	}
+}
+
+
+// Write an xres * yres image of packed 8-bit RGB, returns false if the file couldn't be written
+inline bool writePNG(const char * const path, const int xres, const int yres, const uint8_t * const rgb)
+{
+	using namespace png_detail;
+
+	const size_t row_bytes = (size_t)xres * 3;
+	const int num_strips = (yres + strip_rows - 1) / strip_rows;
+	std::vector<std::vector<uint8_t>> strips(num_strips); // IDAT chunk contents
+	std::vector<uint32_t> strip_adler(num_strips);
+	std::vector<size_t> strip_size(num_strips);
+
+	#pragma omp parallel for schedule(dynamic)
+	for (int strip = 0; strip < num_strips; ++strip)
+	{
+		const int y0 = strip * strip_rows;
+		const int y1 = std::min(y0 + strip_rows, yres);
+
+		std::vector<uint8_t> filtered((row_bytes + 1) * (y1 - y0)), temp, zero_row((y0 == 0) ? row_bytes : 0, 0);
+		for (int y = y0; y < y1; ++y)
+			filterRow(rgb + row_bytes * y, (y > 0) ? rgb + row_bytes * (y - 1) : zero_row.data(), (int)row_bytes, &filtered[(row_bytes + 1) * (y - y0)], temp);
+
+		std::vector<uint8_t> & out = strips[strip];
+		if (strip == 0)
+		{
+			out.push_back(0x78); // zlib header: deflate with a 32K window, no dictionary
+			out.push_back(0x01);
+		}
+		deflate(filtered.data(), (int)filtered.size(), strip == num_strips - 1, out);
+		strip_adler[strip] = adler32(filtered.data(), filtered.size());
+		strip_size[strip] = filtered.size();
+	}
+
+	// The zlib stream ends with the checksum of all the uncompressed data
+	uint32_t adler = strip_adler[0];
+	for (int strip = 1; strip < num_strips; ++strip)
+		adler = adler32Combine(adler, strip_adler[strip], strip_size[strip]);
+	const uint8_t adler_bytes[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+	strips.back().insert(strips.back().end(), adler_bytes, adler_bytes + 4);
+
+	FILE * const f = fopen(path, "wb");
+	if (f == nullptr)
+		return false;
+
+	// Chunks are the big-endian size, type, data and the CRC of the type and data
+	std::vector<uint8_t> chunk;
+	const auto write_chunk = [&](const char * type, const uint8_t * data, const size_t size) -> bool
+	{
+		const uint32_t n = (uint32_t)size;
+		chunk.assign({ (uint8_t)(n >> 24), (uint8_t)(n >> 16), (uint8_t)(n >> 8), (uint8_t)n });
+		chunk.insert(chunk.end(), type, type + 4);
+		chunk.insert(chunk.end(), data, data + size);
+		const uint32_t crc = crc32(0, chunk.data() + 4, size + 4);
+		const uint8_t crc_bytes[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+		chunk.insert(chunk.end(), crc_bytes, crc_bytes + 4);
+		return fwrite(chunk.data(), 1, chunk.size(), f) == chunk.size();
+	};
+
+	const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	const uint8_t header[13] =
+	{
+		(uint8_t)(xres >> 24), (uint8_t)(xres >> 16), (uint8_t)(xres >> 8), (uint8_t)xres,
+		(uint8_t)(yres >> 24), (uint8_t)(yres >> 16), (uint8_t)(yres >> 8), (uint8_t)yres,
+		8, 2, 0, 0, 0 // 8 bits per channel, RGB, deflate, adaptive filtering, not interlaced
+	};
+
+	bool ok = fwrite(signature, 1, 8, f) == 8 && write_chunk("IHDR", header, 13);
+	for (int strip = 0; strip < num_strips && ok; ++strip)
+		ok = write_chunk("IDAT", strips[strip].data(), strips[strip].size());
+	ok = ok && write_chunk("IEND", nullptr, 0);
+
+	return (fclose(f) == 0) && ok;
+}
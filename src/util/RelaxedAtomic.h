@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+
+
+// Accumulator that render threads add to concurrently, using relaxed atomics since the totals are only used as statistics
+//  and nothing is ordered by them. Floats add with a compare-exchange loop, as std::atomic<float>::fetch_add is C++20.
+// Copying isn't atomic as a whole, so that containers of them stay copyable, which is only done while nobody is adding.
+template <typename T>
+struct RelaxedAtomic
+{
+	RelaxedAtomic(const T v = T()) noexcept : value(v) { }
+	RelaxedAtomic(const RelaxedAtomic & a) noexcept : value(a.load()) { }
+
+	RelaxedAtomic & operator=(const RelaxedAtomic & a) noexcept { store(a.load()); return *this; }
+	RelaxedAtomic & operator=(const T v) noexcept { store(v); return *this; }
+
+	T load() const noexcept { return value.load(std::memory_order_relaxed); }
+	void store(const T v) noexcept { value.store(v, std::memory_order_relaxed); }
+	operator T() const noexcept { return load(); }
+
+	void add(const T v) noexcept
+	{
+		if constexpr (std::is_integral_v<T>)
+			value.fetch_add(v, std::memory_order_relaxed);
+		else
+		{
+			T old = value.load(std::memory_order_relaxed);
+			while (!value.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) { }
+		}
+	}
+
+private:
+	std::atomic<T> value;
+};
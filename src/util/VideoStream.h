@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#if !_WIN32
+#include <signal.h>
+#endif
+
+
+enum VideoOutput { video_ffmpeg, video_y4m, video_png };
+
+// Check that ffmpeg can be run, since popen succeeds even if it can't
+inline bool ffmpegAvailable()
+{
+#if _WIN32
+	return system("ffmpeg -version > NUL 2>&1") == 0;
+#else
+	return system("ffmpeg -version > /dev/null 2>&1") == 0;
+#endif
+}
+
+
+// Writes 8-bit RGB frames to a video as they're rendered, without saving and reloading images in between.
+// With ffmpeg the frames are piped raw to its stdin and encoded to H.264, otherwise they go to an uncompressed YUV4MPEG2
+//  file with 4:4:4 chroma, which ffmpeg and most players read directly.
+struct VideoStream
+{
+	std::string path;
+
+	~VideoStream() { close(); }
+
+	bool open(const std::string & name, const VideoOutput output, const int xres_, const int yres_, const int fps)
+	{
+		xres = xres_;
+		yres = yres_;
+		piped = output == video_ffmpeg;
+
+		if (piped)
+		{
+			path = name + ".mp4";
+			char cmd[512];
+			snprintf(cmd, sizeof(cmd),
+				"ffmpeg -y -loglevel error -f rawvideo -pix_fmt rgb24 -video_size %dx%d -framerate %d -i - -c:v libx264 -pix_fmt yuv420p -crf 18 %s",
+				xres, yres, fps, path.c_str());
+#if _WIN32
+			file = _popen(cmd, "wb");
+#else
+			signal(SIGPIPE, SIG_IGN); // Report writes after ffmpeg dies as errors rather than being killed
+			file = popen(cmd, "w");
+#endif
+			return file != nullptr;
+		}
+
+		path = name + ".y4m";
+		file = fopen(path.c_str(), "wb");
+		return file != nullptr && fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", xres, yres, fps) > 0;
+	}
+
+	bool writeFrame(const uint8_t * const rgb)
+	{
+		const size_t num_pixels = (size_t)xres * yres;
+		if (piped)
+			return fwrite(rgb, 3, num_pixels, file) == num_pixels;
+
+		// Planar Y'CbCr with BT.601 coefficients in the limited range, which is what readers assume without further tags
+		yuv.resize(num_pixels * 3);
+		#pragma omp parallel for
+		for (int y = 0; y < yres; ++y)
+		for (int x = 0; x < xres; ++x)
+		{
+			const size_t i = (size_t)y * xres + x;
+			const int r = rgb[i * 3 + 0], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+			yuv[i]                  = (uint8_t)((( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16);
+			yuv[i + num_pixels]     = (uint8_t)(((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128);
+			yuv[i + num_pixels * 2] = (uint8_t)(((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
+		}
+
+		return fputs("FRAME\n", file) >= 0 && fwrite(yuv.data(), 1, yuv.size(), file) == yuv.size();
+	}
+
+	// Returns false if the file couldn't be finished or the encoder failed
+	bool close()
+	{
+		if (file == nullptr)
+			return true;
+
+#if _WIN32
+		const bool ok = (piped ? _pclose(file) : fclose(file)) == 0;
+#else
+		const bool ok = (piped ? pclose(file) : fclose(file)) == 0;
+#endif
+		file = nullptr;
+		return ok;
+	}
+
+private:
+	FILE * file = nullptr;
+	bool piped = false;
+	int xres = 0, yres = 0;
+	std::vector<uint8_t> yuv;
+};